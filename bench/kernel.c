@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../chunk.h"
+#include "../repair.h"
+#include "../kernel.h"
+#include "../simd.h"
+
+/*
+ * 比较特化内核与通用调度表的吞吐量。
+ *
+ * 对每个有特化内核的质数、每种单元大小和每种损坏情况，分别用两种方法处理同样
+ * 的一批 chunk，输出以原始数据计的 MB/s，并检查两者的结果是否一致。最后一列是
+ * 调度表按 BATCH_BYTES 交错处理同样多的数据时的吞吐量，即不使用特化内核时
+ * batch_size() 的选择，特化内核应当比它快才值得使用。
+ */
+
+#define POOL_BYTES (32 * 1024 * 1024)
+#define ROUNDS (5)
+#define BATCH_BYTES (2048) /* 与 evenodd.c 相同 */
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double run(Chunk **chunks, size_t num, const Schedule *sched, KernelFn kernel) {
+    double best = 1e30;
+    for (int r = 0; r < ROUNDS; ++r) {
+        double begin = now();
+        for (size_t k = 0; k < num; ++k) {
+            if (kernel != NULL)
+                kernel(chunks[k], sched->i, sched->j);
+            else
+                schedule_run(sched, chunks[k]);
+        }
+        double t = now() - begin;
+        best = t < best ? t : best;
+    }
+    return best;
+}
+
+/**
+ * new_chunks() - 分配足以装下 POOL_BYTES 原始数据的 Chunk，每个交错 batch 个
+ *                chunk，填入随机数据并计算校验列
+ */
+static Chunk **new_chunks(int p, size_t cell, int batch, size_t *num) {
+    size_t raw = cell * sizeof(Packet) * p * (p - 1) * batch;
+    *num = POOL_BYTES / raw + 1;
+    Chunk **chunks = malloc(*num * sizeof(Chunk *));
+    for (size_t k = 0; k < *num; ++k) {
+        chunks[k] = chunk_new(p, cell, batch);
+        for (size_t x = 0; x < cell * batch * p * (p - 1); ++x)
+            chunks[k]->data[x] = ((Packet)rand() << 32) ^ rand();
+        schedule_run(schedule_get(p, p, p + 1), chunks[k]);
+    }
+    return chunks;
+}
+
+static void free_chunks(Chunk **chunks, size_t num) {
+    for (size_t k = 0; k < num; ++k)
+        free(chunks[k]);
+    free(chunks);
+}
+
+int main(void) {
+    static const int primes[] = { 7, 11, 13, 17 };
+    static const size_t cells[] = { 8, 16, 32, 64 };
+
+    simd_init();
+    printf("kernel: %s\n", simd.name);
+    printf("%4s %6s %-10s %10s %10s %8s %12s\n", "p", "cell", "case", "sched MB/s", "kernel MB/s",
+            "speedup", "batched MB/s");
+
+    for (size_t a = 0; a < sizeof(primes) / sizeof(primes[0]); ++a) {
+        int p = primes[a];
+        for (size_t b = 0; b < sizeof(cells) / sizeof(cells[0]); ++b) {
+            size_t cell = cells[b] / sizeof(Packet);
+            size_t raw = cells[b] * p * (p - 1);
+            int batch = raw < BATCH_BYTES ? BATCH_BYTES / raw : 1;
+            size_t num, batched_num;
+            Chunk **chunks = new_chunks(p, cell, 1, &num);
+            Chunk **batched = new_chunks(p, cell, batch, &batched_num);
+            Chunk *check = chunk_new(p, cell, 1);
+
+            int patterns[4][2] = { { p, p + 1 }, { 1, p }, { 1, p + 1 }, { 0, 2 } };
+            const char *names[4] = { "encode", "data+row", "data+diag", "data+data" };
+            for (int c = 0; c < 4; ++c) {
+                int i = patterns[c][0], j = patterns[c][1];
+                const Schedule *sched = schedule_get(p, i, j);
+                KernelFn kernel = kernel_get(p, 1);
+                double ts = run(chunks, num, sched, NULL);
+                memcpy(check->data, chunks[0]->data, chunk_data_size(p, cell));
+                double tk = run(chunks, num, sched, kernel);
+                if (memcmp(check->data, chunks[0]->data, chunk_data_size(p, cell)) != 0) {
+                    fprintf(stderr, "p=%d cell=%zu %s: kernel and schedule differ\n",
+                            p, cells[b], names[c]);
+                    return 1;
+                }
+                double tb = run(batched, batched_num, sched, NULL);
+                double mb = (double)num * raw / 1e6;
+                double batched_mb = (double)batched_num * raw * batch / 1e6;
+                printf("%4d %6zu %-10s %10.0f %10.0f %7.2fx %12.0f\n", p, cells[b], names[c],
+                        mb / ts, mb / tk, ts / tk, batched_mb / tb);
+            }
+
+            free_chunks(chunks, num);
+            free_chunks(batched, batched_num);
+            free(check);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,5 @@
+#!/bin/bash
+cd "$(dirname "$0")" || exit 1
+gcc -O2 -pthread -std=gnu11 kernel.c ../chunk.c ../repair.c ../simd.c ../kernel.c ../mmio/mmio-mixed.c -o kernel
+./kernel
+rm kernel
@@ -0,0 +1,597 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "packet.h"
+#include "util.h"
+#include "catalog.h"
+#include "pack.h"
+
+/**
+ * crc32() - 逐位计算的 CRC-32，目录中的记录都很短，不必查表
+ */
+static uint32_t crc32(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *s = (const unsigned char *)data;
+    crc = ~crc;
+    while (len-- != 0) {
+        crc ^= *s++;
+        for (int k = 0; k < 8; ++k)
+            crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+    }
+    return ~crc;
+}
+
+/**
+ * record_crc() - 计算一条记录的 crc，两种记录的 crc 都紧跟在 magic 之后
+ *
+ * @size - CatalogRecord 或 CatalogPacked 的大小
+ */
+static uint32_t record_crc(const void *rec, size_t size, const char *name, size_t len) {
+    char tmp[sizeof(CatalogRecord)];
+    memcpy(tmp, rec, size);
+    memset(tmp + sizeof(uint32_t), 0, sizeof(uint32_t));
+    return crc32(crc32(0, tmp, size), name, len);
+}
+
+static int open_replica(int i, int flags) {
+    char path[PATH_MAX];
+    sprintf(path, "disk_%d/" CATALOG_NAME, i);
+    return open(path, flags, 0644);
+}
+
+static size_t file_size(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+/**
+ * replica_generation() - 目录开头的 CatalogHeader 中的代数，没有时为 0
+ */
+static uint64_t replica_generation(int fd) {
+    CatalogHeader h;
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != CATALOG_HEADER_MAGIC)
+        return 0;
+    return h.generation;
+}
+
+/**
+ * read_replica() - 读出 fd 的前 size 个字节，返回实际读到的字节数
+ *
+ * *buf 多分配一个字节，size 为 0 时也不是 NULL，由调用者释放。
+ */
+static size_t read_replica(int fd, size_t size, char **buf) {
+    size_t got = 0;
+    *buf = malloc(size + 1);
+    assert(*buf != NULL);
+    while (got < size) {
+        ssize_t n = pread(fd, *buf + got, size - got, got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/**
+ * replace_replica() - 用 buf 中的 size 个字节替换第 i 份目录，并重新打开 c->fds[i]
+ *
+ * 先写入临时文件再 rename()，没有加锁的读者看到的总是完整的旧目录或新目录。
+ * 其他进程中打开的旧目录的链接数变为 0，下一次追加前重新打开，见
+ * reopen_replicas()。
+ */
+static void replace_replica(Catalog *c, int i, const char *buf, size_t size) {
+    char tmp[PATH_MAX], path[PATH_MAX];
+    sprintf(tmp, "disk_%d/" CATALOG_NAME ".tmp", i);
+    sprintf(path, "disk_%d/" CATALOG_NAME, i);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd != -1);
+    for (size_t pos = 0; pos < size;) {
+        ssize_t n = write(fd, buf + pos, size - pos);
+        assert(n > 0);
+        pos += n;
+    }
+    fsync(fd);
+    close(fd);
+    int ret = rename(tmp, path);
+    assert(ret == 0);
+    (void)ret;
+    close(c->fds[i]);
+    c->fds[i] = open_replica(i, O_RDWR | O_APPEND | O_CREAT);
+    assert(c->fds[i] != -1);
+}
+
+/**
+ * reopen_replicas() - 重新打开已经被其他进程压缩替换掉的目录，持有锁时调用
+ */
+static void reopen_replicas(Catalog *c) {
+    for (int i = 0; i < 3; ++i) {
+        struct stat st;
+        if (fstat(c->fds[i], &st) == 0 && st.st_nlink != 0)
+            continue;
+        close(c->fds[i]);
+        c->fds[i] = open_replica(i, O_RDWR | O_APPEND | O_CREAT);
+        assert(c->fds[i] != -1);
+    }
+}
+
+/**
+ * copy_tail() - 把 src 中从 pos 到 size 的字节追加到 dst 末尾
+ *
+ * 各份目录都在锁内按相同的顺序追加，较短的一份总是最长的一份的前缀，只需补上
+ * 缺少的部分。
+ */
+static void copy_tail(int dst, int src, size_t pos, size_t size) {
+    char buf[64 * 1024];
+    while (pos < size) {
+        ssize_t n = pread(src, buf, MIN(sizeof(buf), size - pos), pos);
+        if (n <= 0)
+            break;
+        ssize_t w = write(dst, buf, n);
+        assert(w == n);
+        (void)w;
+        pos += n;
+    }
+}
+
+typedef struct {
+    unsigned seg;
+    size_t size;
+} SeedSegment;
+
+static int cmp_segment(const void *a, const void *b) {
+    unsigned x = ((const SeedSegment *)a)->seg, y = ((const SeedSegment *)b)->seg;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * seed_packed() - 把容器段中的文件登记到目录中
+ *
+ * @dir - 磁盘目录，其中单独保存的同名文件优先，不登记打包的那份
+ *
+ * 容器段按编号从小到大登记，编号大的在后，读出目录时以它为准。无法读出索引的
+ * 容器段只报告，不影响其他容器段。
+ */
+static void seed_packed(Catalog *c, int dir, SeedSegment *segs, size_t num) {
+    /* 没有容器段时 segs 为 NULL，不能传给 qsort() */
+    if (num == 0)
+        return;
+    qsort(segs, num, sizeof(SeedSegment), cmp_segment);
+    for (size_t k = 0; k < num; ++k) {
+        PackFile *files;
+        char *buf;
+        size_t n = pack_read_index(segs[k].seg, segs[k].size, &files, &buf);
+        if (n == (size_t)-1) {
+            fprintf(stderr, PACK_PREFIX "%u: bad pack segment, skipped\n", segs[k].seg);
+            continue;
+        }
+        for (size_t t = 0; t < n; ++t) {
+            if (faccessat(dir, files[t].name, F_OK, 0) != 0)
+                catalog_add_packed(c, files[t].name, segs[k].seg, files[t].offset, files[t].length);
+        }
+        free(files);
+        free(buf);
+    }
+}
+
+/**
+ * seed_catalog() - 遍历已有的磁盘文件，为旧版本写入的磁盘建立目录
+ */
+static void seed_catalog(Catalog *c) {
+    for (int i = 0; i < 3; ++i) {
+        char path[PATH_MAX];
+        sprintf(path, "disk_%d", i);
+        DIR *dir = opendir(path);
+        if (dir == NULL)
+            continue;
+        int dirs[METADATA_DISKS] = { dirfd(dir), -1, -1, -1, -1 };
+        SeedSegment *segs = NULL;
+        size_t seg_num = 0, seg_cap = 0;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            const char *name = entry->d_name;
+            Metadata meta;
+            unsigned seg;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, CATALOG_NAME) == 0)
+                continue;
+            if (!get_cooked_file_metadata_at(dirs, name, &meta) || meta.p < 3)
+                continue;
+            catalog_add(c, name, &meta);
+            if (!pack_segment_number(name, &seg))
+                continue;
+            if (seg_num == seg_cap) {
+                seg_cap = MAX(seg_cap * 2, 16);
+                segs = realloc(segs, seg_cap * sizeof(SeedSegment));
+                assert(segs != NULL);
+            }
+            segs[seg_num++] = (SeedSegment) { seg, meta.size };
+        }
+        seed_packed(c, dirs[0], segs, seg_num);
+        free(segs);
+        closedir(dir);
+        return;
+    }
+}
+
+/**
+ * catalog_open() - 打开目录以便追加记录
+ *
+ * 各份目录不一致时（例如磁盘损坏后还没有修复，或者追加到一半时中断），以代数
+ * 最大、其次最长的一份为准：代数相同的只补上缺少的部分，代数较小的（压缩到一
+ * 半时中断）整个替换。都不存在时遍历已有的磁盘文件建立目录。
+ */
+void catalog_open(Catalog *c) {
+    uint64_t gen[3];
+    size_t size[3];
+    int best = 0;
+
+    for (int i = 0; i < 3; ++i) {
+        char path[PATH_MAX];
+        sprintf(path, "disk_%d", i);
+        mkdir(path, 0755);
+    }
+    c->dir = open("disk_0", O_RDONLY | O_DIRECTORY);
+    assert(c->dir != -1);
+    for (int i = 0; i < 3; ++i) {
+        c->fds[i] = open_replica(i, O_RDWR | O_APPEND | O_CREAT);
+        assert(c->fds[i] != -1);
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    c->seeding = 0;
+
+    /* 同时写入的各个进程在这里排队，只有一个进程建立或补齐目录 */
+    flock(c->dir, LOCK_EX);
+    reopen_replicas(c);
+    for (int i = 0; i < 3; ++i) {
+        gen[i] = replica_generation(c->fds[i]);
+        size[i] = file_size(c->fds[i]);
+        if (gen[i] > gen[best] || (gen[i] == gen[best] && size[i] > size[best]))
+            best = i;
+    }
+    if (size[best] == 0) {
+        /* 已经持有 flock()，建立目录时追加记录不必再加锁 */
+        c->seeding = 1;
+        seed_catalog(c);
+        c->seeding = 0;
+    } else {
+        char *buf = NULL;
+        for (int i = 0; i < 3; ++i) {
+            if (gen[i] == gen[best] && size[i] != size[best]) {
+                copy_tail(c->fds[i], c->fds[best], size[i], size[best]);
+            } else if (gen[i] != gen[best]) {
+                if (buf == NULL)
+                    size[best] = read_replica(c->fds[best], size[best], &buf);
+                replace_replica(c, i, buf, size[best]);
+            }
+        }
+        free(buf);
+    }
+    c->size = file_size(c->fds[0]);
+    flock(c->dir, LOCK_UN);
+}
+
+/**
+ * append_record() - 在每份目录中追加 buf 中的一条记录，共 size 个字节
+ *
+ * 每份目录都只调用一次 write()，以 O_APPEND 打开，记录不会交错。同一进程中的
+ * 线程由 lock 排队，不同的进程由磁盘 0 的目录上的 flock() 排队，与
+ * catalog_open() 补齐目录、catalog_close() 压缩目录互斥，所以各份目录中记录的
+ * 顺序相同。
+ */
+static void append_record(Catalog *c, const char *buf, size_t size) {
+    pthread_mutex_lock(&c->lock);
+    if (!c->seeding) {
+        flock(c->dir, LOCK_EX);
+        reopen_replicas(c);
+    }
+    for (int i = 0; i < 3; ++i) {
+        ssize_t ret = write(c->fds[i], buf, size);
+        assert(ret == (ssize_t)size);
+        (void)ret;
+    }
+    if (!c->seeding)
+        flock(c->dir, LOCK_UN);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * encode_record() - 在 buf 中写好单独保存的文件 name 的一条记录，返回其字节数
+ */
+static size_t encode_record(char *buf, const char *name, const Metadata *meta) {
+    CatalogRecord rec = {
+        .magic = CATALOG_MAGIC,
+        .p = meta->p,
+        .cell = meta->cell,
+        .version = meta->header_size != sizeof(MetadataV0),
+        .len = strlen(name) + 1,
+        .size = meta->size,
+        .chunks = meta->full_chunk_num + (meta->last_chunk_data_size != 0),
+        .rotate = meta->rotate,
+    };
+    assert(rec.len <= NAME_MAX + 1);
+    rec.crc = record_crc(&rec, sizeof(rec), name, rec.len);
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), name, rec.len);
+    return sizeof(rec) + rec.len;
+}
+
+/**
+ * encode_packed() - 在 buf 中写好打包在容器段 seg 中的文件 name 的一条记录，返回
+ *                   其字节数
+ */
+static size_t encode_packed(char *buf, const char *name, unsigned seg, size_t offset, size_t length) {
+    CatalogPacked rec = {
+        .magic = CATALOG_PACKED_MAGIC,
+        .seg = seg,
+        .len = strlen(name) + 1,
+        .offset = offset,
+        .length = length,
+    };
+    assert(rec.len <= NAME_MAX + 1);
+    rec.crc = record_crc(&rec, sizeof(rec), name, rec.len);
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), name, rec.len);
+    return sizeof(rec) + rec.len;
+}
+
+/**
+ * catalog_add() - 在目录中登记单独保存的文件 name
+ */
+void catalog_add(Catalog *c, const char *name, const Metadata *meta) {
+    char buf[CATALOG_RECORD_MAX];
+    append_record(c, buf, encode_record(buf, name, meta));
+}
+
+/**
+ * catalog_add_packed() - 在目录中登记打包在容器段 seg 中的文件 name
+ */
+void catalog_add_packed(Catalog *c, const char *name, unsigned seg, size_t offset, size_t length) {
+    char buf[CATALOG_RECORD_MAX];
+    append_record(c, buf, encode_packed(buf, name, seg, offset, length));
+}
+
+/**
+ * check_record() - 检查 buf 开头的记录头和文件名是否完整、crc 是否正确
+ *
+ * @size - 记录头的大小
+ * @len - 记录头中文件名的字节数
+ */
+static int check_record(const char *buf, size_t left, size_t size, uint32_t len, uint32_t crc) {
+    const char *name = buf + size;
+    return len >= 2 && len <= NAME_MAX + 1 && len <= left - size && name[len - 1] == '\0'
+        && record_crc(buf, size, name, len) == crc;
+}
+
+/**
+ * parse_record() - 检查 buf 开头的一条 CatalogRecord，合法时得到文件的 Metadata
+ *
+ * @left - buf 中剩余的字节数
+ */
+static int parse_record(const char *buf, size_t left, CatalogRecord *rec, Metadata *meta) {
+    if (left < sizeof(*rec))
+        return 0;
+    memcpy(rec, buf, sizeof(*rec));
+    if (rec->magic != CATALOG_MAGIC || !check_record(buf, left, sizeof(*rec), rec->len, rec->crc))
+        return 0;
+    if (rec->p < 3 || rec->p > PMAX || rec->version > 1 || rec->cell < sizeof(Packet)
+            || (rec->cell & (rec->cell - 1)) != 0 || rec->rotate >= rec->p + 2
+            || (rec->version == 0 && rec->rotate != 0))
+        return 0;
+
+    meta->p = rec->p;
+    meta->cell = rec->cell;
+    meta->header_size = rec->version == 1 ? METADATA_SIZE : sizeof(MetadataV0);
+    meta->rotate = rec->rotate;
+    metadata_set_size(meta, rec->size);
+    return meta->full_chunk_num + (meta->last_chunk_data_size != 0) == rec->chunks;
+}
+
+/**
+ * parse_packed() - 检查 buf 开头的一条 CatalogPacked，合法时得到目录中的一项
+ */
+static int parse_packed(const char *buf, size_t left, CatalogPacked *rec, CatalogEntry *e) {
+    if (left < sizeof(*rec))
+        return 0;
+    memcpy(rec, buf, sizeof(*rec));
+    if (rec->magic != CATALOG_PACKED_MAGIC || !check_record(buf, left, sizeof(*rec), rec->len, rec->crc)
+            || rec->offset + rec->length < rec->offset)
+        return 0;
+    *e = (CatalogEntry) { .packed = 1, .seg = rec->seg, .offset = rec->offset };
+    e->meta.size = rec->length;
+    return 1;
+}
+
+static size_t hash_name(const char *name) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (; *name != '\0'; ++name)
+        h = (h ^ (unsigned char)*name) * 0x100000001b3ull;
+    return (size_t)h;
+}
+
+/**
+ * find_slot() - 在散列表中找到 name 所在的位置，不存在时为应当插入的空位
+ */
+static size_t find_slot(const CatalogIndex *x, const char *name) {
+    size_t k = hash_name(name) & x->mask;
+    while (x->slots[k] != 0 && strcmp(x->entries[x->slots[k] - 1].name, name) != 0)
+        k = (k + 1) & x->mask;
+    return k;
+}
+
+/**
+ * index_records() - 建立 x->buf 中前 size 个字节的散列表
+ *
+ * 写了一半的记录被跳过，从其后的下一条合法记录继续。返回合法记录的条数，减去
+ * x->num 就是已经被后面的记录取代的条数。
+ */
+static size_t index_records(CatalogIndex *x, size_t size) {
+    size_t cap = size / sizeof(CatalogPacked) + 1;
+    size_t slots = 16, records = 0;
+    while (slots < cap * 2)
+        slots *= 2;
+    x->entries = malloc(cap * sizeof(CatalogEntry));
+    x->slots = calloc(slots, sizeof(size_t));
+    assert(x->entries != NULL && x->slots != NULL);
+    x->mask = slots - 1;
+
+    CatalogRecord rec;
+    CatalogPacked packed;
+    CatalogEntry e;
+    Metadata meta;
+    size_t pos = 0;
+    if (size >= sizeof(CatalogHeader) && ((const CatalogHeader *)x->buf)->magic == CATALOG_HEADER_MAGIC)
+        pos = sizeof(CatalogHeader);
+    while (pos < size) {
+        const char *buf = x->buf + pos;
+        if (parse_record(buf, size - pos, &rec, &meta)) {
+            e = (CatalogEntry) { .name = buf + sizeof(rec), .meta = meta };
+            pos += sizeof(rec) + rec.len;
+        } else if (parse_packed(buf, size - pos, &packed, &e)) {
+            e.name = buf + sizeof(packed);
+            pos += sizeof(packed) + packed.len;
+        } else {
+            ++pos;
+            continue;
+        }
+        ++records;
+        size_t k = find_slot(x, e.name);
+        if (x->slots[k] == 0) {
+            x->entries[x->num] = e;
+            x->slots[k] = ++x->num;
+        } else {
+            e.name = x->entries[x->slots[k] - 1].name;
+            x->entries[x->slots[k] - 1] = e;
+        }
+    }
+    return records;
+}
+
+/**
+ * catalog_load() - 读出整个目录
+ *
+ * 读取代数最大、其次最长的一份，与 catalog_open() 选择的相同。各份相同时按进程
+ * 号选择从哪一份开始，不同进程的读取分散在磁盘 0 1 和 2 上，而不是都落在磁盘 0
+ * 上。
+ *
+ * 返回是否存在目录，不存在时 x 为空。
+ */
+int catalog_load(CatalogIndex *x) {
+    int fd = -1;
+    uint64_t gen = 0;
+    size_t size = 0;
+    int first = getpid() % 3;
+
+    *x = (CatalogIndex) { 0 };
+    for (int k = 0; k < 3; ++k) {
+        int f = open_replica((first + k) % 3, O_RDONLY);
+        if (f == -1)
+            continue;
+        uint64_t g = replica_generation(f);
+        size_t s = file_size(f);
+        if (fd == -1 || g > gen || (g == gen && s > size)) {
+            if (fd != -1)
+                close(fd);
+            fd = f;
+            gen = g;
+            size = s;
+        } else {
+            close(f);
+        }
+    }
+    if (fd == -1)
+        return 0;
+
+    size = read_replica(fd, size, &x->buf);
+    close(fd);
+    index_records(x, size);
+    return 1;
+}
+
+/**
+ * catalog_find() - 在目录中查找磁盘中名为 name 的文件，找不到时返回 NULL
+ */
+const CatalogEntry *catalog_find(const CatalogIndex *x, const char *name) {
+    if (x->slots == NULL)
+        return NULL;
+    size_t k = find_slot(x, name);
+    return x->slots[k] != 0 ? &x->entries[x->slots[k] - 1] : NULL;
+}
+
+void catalog_free(CatalogIndex *x) {
+    free(x->entries);
+    free(x->slots);
+    free(x->buf);
+    *x = (CatalogIndex) { 0 };
+}
+
+/**
+ * catalog_compact() - 只保留每个文件的最后一条记录，重写各份目录，持有锁时调用
+ *
+ * 新的目录开头是代数加 1 的 CatalogHeader，依次替换各份目录。中途中断时各份目
+ * 录的代数不同，下一次 catalog_open() 以代数大的为准。
+ */
+static void catalog_compact(Catalog *c) {
+    CatalogIndex x = { 0 };
+    size_t size = read_replica(c->fds[0], file_size(c->fds[0]), &x.buf);
+    size_t records = index_records(&x, size);
+
+    /* 被取代的记录不比有效的多时不值得重写 */
+    if (records - x.num > x.num) {
+        CatalogHeader h = { CATALOG_HEADER_MAGIC, 0, replica_generation(c->fds[0]) + 1 };
+        char *buf = malloc(sizeof(h) + x.num * CATALOG_RECORD_MAX);
+        assert(buf != NULL);
+        memcpy(buf, &h, sizeof(h));
+        size_t len = sizeof(h);
+        for (size_t k = 0; k < x.num; ++k) {
+            const CatalogEntry *e = &x.entries[k];
+            if (e->packed)
+                len += encode_packed(buf + len, e->name, e->seg, e->offset, e->meta.size);
+            else
+                len += encode_record(buf + len, e->name, &e->meta);
+        }
+        for (int i = 0; i < 3; ++i)
+            replace_replica(c, i, buf, len);
+        free(buf);
+    }
+    catalog_free(&x);
+}
+
+static int log2_size(size_t x) {
+    return x == 0 ? -1 : 63 - __builtin_clzl(x);
+}
+
+/**
+ * catalog_close() - 关闭目录，目录变长时可能先压缩
+ *
+ * 只在目录的长度达到 CATALOG_COMPACT_BYTES、且在打开之后越过了某个 2 的整数次
+ * 幂时才检查，检查要读出整个目录，这样分摊到每个追加的字节上是常数。被取代的
+ * 记录多于有效的记录时压缩，所以目录的长度始终不超过有效记录的四倍左右（或
+ * CATALOG_COMPACT_BYTES），读出目录的开销取决于现有的文件，而不是写入的历史。
+ */
+void catalog_close(Catalog *c) {
+    flock(c->dir, LOCK_EX);
+    reopen_replicas(c);
+    size_t size = file_size(c->fds[0]);
+    if (size >= CATALOG_COMPACT_BYTES && log2_size(size) > log2_size(c->size))
+        catalog_compact(c);
+    flock(c->dir, LOCK_UN);
+    for (int i = 0; i < 3; ++i)
+        close(c->fds[i]);
+    close(c->dir);
+    pthread_mutex_destroy(&c->lock);
+}
+
+/**
+ * catalog_sync() - 补齐损坏的磁盘中的目录，repair 操作之后调用
+ */
+void catalog_sync(void) {
+    Catalog c;
+    catalog_open(&c);
+    catalog_close(&c);
+}
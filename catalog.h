@@ -0,0 +1,153 @@
+#ifndef CATALOG_H_
+#define CATALOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "metadata.h"
+
+/**
+ * 文件目录
+ *
+ * 磁盘 0 1 和 2 中各有一份相同的 CATALOG_NAME，依次记录写入的每个磁盘文件的
+ * CatalogRecord 及其以 '\0' 结尾的磁盘文件名。目录只追加不改写，同名的文件以
+ * 最后一条记录为准；被取代的记录多于有效的记录时整个重写，见 catalog_close()。
+ * 任意两个磁盘损坏时至少还有一份完好，repair 操作之后补齐。
+ *
+ * 打包在容器段中的文件（见 pack.h）各有一条 CatalogPacked 记录，记录其所在的容
+ * 器段和位置，同样以最后一条记录为准。
+ *
+ * 有了目录，repair 操作不必遍历磁盘目录、逐个读取磁盘文件开头的 Metadata，也
+ * 能直接跳过与损坏的磁盘无关的文件：使用质数 p 的文件只占用磁盘 0 到 p+1。list
+ * 操作和读取打包的文件也只需要读出目录。读取单独保存的文件时仍然直接打开磁盘
+ * 文件，反正也要打开它们读取数据。
+ *
+ * 目录固定在磁盘 0 1 和 2 中，不像校验列和 Metadata 那样轮转（见 metadata.h）：
+ * 加载时不必在所有磁盘中查找，每次写入在这三个磁盘中各追加一条记录，读出目录
+ * 时按进程在三份之间分散。
+ *
+ * 旧版本写入的磁盘没有目录，第一次写入时先遍历已有的文件、读出容器段中的索引
+ * 建立目录。
+ */
+
+#define CATALOG_NAME ".evenodd-catalog"
+#define CATALOG_MAGIC (0x474c5443u) /* "CTLG" */
+#define CATALOG_PACKED_MAGIC (0x504c5443u) /* "CTLP" */
+#define CATALOG_HEADER_MAGIC (0x484c5443u) /* "CTLH" */
+
+/**
+ * CATALOG_COMPACT_BYTES - 目录短于此时不压缩，见 catalog_close()
+ */
+#define CATALOG_COMPACT_BYTES (64 * 1024)
+
+/**
+ * CatalogRecord - 目录中的一条记录，其后紧跟磁盘文件名
+ *
+ * @crc - 整条记录（包括文件名，crc 记为 0）的 CRC-32，用于识别写了一半的记录
+ * @version - 磁盘文件开头 Metadata 的格式，见 metadata.h
+ * @len - 文件名的字节数，包括 '\0'
+ * @chunks - chunk 数量，包括未满的最后一个 chunk
+ * @rotate - 校验列轮转的位数，见 metadata.h
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;
+    uint32_t p;
+    uint32_t cell;
+    uint32_t version;
+    uint32_t len;
+    uint64_t size;
+    uint64_t chunks;
+    uint32_t rotate;
+    uint32_t reserved;
+} CatalogRecord;
+
+/**
+ * CatalogPacked - 目录中打包在容器段中的一个文件，其后紧跟磁盘文件名
+ *
+ * @crc @len - 与 CatalogRecord 相同
+ * @seg - 所在容器段的编号
+ * @offset @length - 在容器段中的位置和长度
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;
+    uint32_t seg;
+    uint32_t len;
+    uint64_t offset;
+    uint64_t length;
+} CatalogPacked;
+
+/**
+ * CatalogHeader - 压缩过的目录开头的记录，见 catalog_close()
+ *
+ * @generation - 压缩的次数，各份目录不同时以大的为准；没有 CatalogHeader 的目
+ *               录为 0
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t generation;
+} CatalogHeader;
+
+/**
+ * CATALOG_RECORD_MAX - 一条记录连同文件名最多占用的字节数
+ */
+#define CATALOG_RECORD_MAX (sizeof(CatalogRecord) + NAME_MAX + 1)
+
+/**
+ * Catalog - 用于追加记录的目录，打开了磁盘 0 1 和 2 中的每一份
+ *
+ * @dir - 磁盘 0 的目录。不同的进程之间用它上面的 flock() 排队，所以各份目录中
+ *        记录的顺序相同；目录文件压缩时被替换，不能锁在目录文件上
+ * @lock - 同一进程中的各个线程依次追加
+ * @seeding - catalog_open() 正持有 flock()，追加时不再加锁
+ * @size - 打开时目录的长度，见 catalog_close()
+ */
+typedef struct {
+    int fds[3];
+    int dir;
+    pthread_mutex_t lock;
+    int seeding;
+    size_t size;
+} Catalog;
+
+/**
+ * CatalogEntry - 从目录中读出的一个文件
+ *
+ * @name - 磁盘文件名，指向 CatalogIndex 中保存的目录，不需要单独释放
+ * @meta - 单独保存的文件的 Metadata；打包的文件只有 size 有意义
+ * @packed - 是否打包在容器段中，是时 seg 和 offset 为其位置
+ */
+typedef struct {
+    const char *name;
+    Metadata meta;
+    int packed;
+    unsigned seg;
+    size_t offset;
+} CatalogEntry;
+
+/**
+ * CatalogIndex - 读出的整个目录，每个文件只保留一项
+ *
+ * @entries - 按文件第一次出现的顺序排列
+ * @slots @mask - 以文件名为键的散列表，保存 entries 的下标加 1，0 表示空位
+ */
+typedef struct {
+    CatalogEntry *entries;
+    size_t num;
+    size_t *slots;
+    size_t mask;
+    char *buf;
+} CatalogIndex;
+
+void catalog_open(Catalog *c);
+void catalog_add(Catalog *c, const char *name, const Metadata *meta);
+void catalog_add_packed(Catalog *c, const char *name, unsigned seg, size_t offset, size_t length);
+void catalog_close(Catalog *c);
+void catalog_sync(void);
+int catalog_load(CatalogIndex *x);
+const CatalogEntry *catalog_find(const CatalogIndex *x, const char *name);
+void catalog_free(CatalogIndex *x);
+
+#endif
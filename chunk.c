@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "packet.h"
 #include <stddef.h>
 #include <stdlib.h>
@@ -7,27 +8,49 @@
 
 #include "chunk.h"
 #include "mmio/mmio.h"
+#include "mmio/mmio-stream.h"
 #include "util.h"
 
-Chunk *chunk_init(Chunk *chunk, int p) {
+#include "simd.h"
+
+Chunk *chunk_init(Chunk *chunk, int p, size_t cell, int batch) {
+    assert(batch >= 1);
     chunk->p = p;
+    chunk->cell = cell;
+    chunk->batch = batch;
+    chunk->num = batch;
+    chunk->raw = chunk->data;
     return chunk;
 }
 
+/**
+ * chunk_aligned() - 单元大小为 cell 时，chunk 池是否对齐 data
+ */
+static int chunk_aligned(size_t cell) {
+    return sizeof(Packet) * cell >= CHUNK_ALIGN;
+}
+
 /**
  * chunk_size() - 计算 chunk 结构体的大小
+ *
+ * @batch - 交错存放的 chunk 数量，大于 1 时还包括能容纳 batch 个 raw chunk 的中
+ *          转区
+ *
+ * 需要对齐时向上取整到 CHUNK_ALIGN，使 chunk 池中相邻的 Chunk 都对齐。
  */
-size_t chunk_size(int p) {
-    size_t num = (p + 2) * (p - 1);
-    return sizeof(Chunk) + sizeof(Packet) * num;
+size_t chunk_size(int p, size_t cell, int batch) {
+    size_t num = (p + 2) * (p - 1) + CHUNK_SCRATCH(p);
+    size_t stage = batch > 1 ? cell * batch * p * (p - 1) : 0;
+    size_t size = sizeof(Chunk) + sizeof(Packet) * (cell * batch * num + stage);
+    return chunk_aligned(cell) ? ROUNDUP(size, CHUNK_ALIGN) : size;
 }
 
 /**
- * chunk_data_size() - 计算 chunk 结构体内数据的大小
+ * chunk_data_size() - 计算单元大小为 cell 时 chunk 矩阵的大小
  */
-size_t chunk_data_size(int p) {
+size_t chunk_data_size(int p, size_t cell) {
     size_t num = (p + 2) * (p - 1);
-    return sizeof(Packet) * num;
+    return sizeof(Packet) * cell * num;
 }
 
 /**
@@ -35,84 +58,293 @@ size_t chunk_data_size(int p) {
  *
  * 会分配内存，返回指向 Chunk 的指针，由调用者释放。
  *
- * 一旦 p 确定，则 cooked chunk 和 raw chunk 的大小就确定了。所以对 Chunk 初始
- * 化时，需要提供 p 作为参数。
+ * 一旦 p、单元大小和 batch 确定，则 cooked chunk 和 raw chunk 的大小就确定了。
+ * 所以对 Chunk 初始化时，需要提供它们作为参数。
  */
-Chunk *chunk_new(int p) {
-    Chunk *result = (Chunk *)malloc(chunk_size(p));
+Chunk *chunk_new(int p, size_t cell, int batch) {
+    Chunk *result = (Chunk *)malloc(chunk_size(p, cell, batch));
     assert(result != NULL);
-    return chunk_init(result, p);
+    return chunk_init(result, p, cell, batch);
+}
+
+/**
+ * chunk_pool_new() - 分配连续存放的 num 个 Chunk 结构体
+ *
+ * @mem - 返回所分配的内存，由调用者用 free() 释放
+ *
+ * 返回第一个 Chunk，第 k 个位于其后 k * chunk_size(p, cell, batch) 字节处，都
+ * 已初始化。单元足够大时，每个 Chunk 的 data 都按 CHUNK_ALIGN 对齐：第一个
+ * Chunk 从对齐位置之前 offsetof(Chunk, data) 字节处开始。
+ */
+Chunk *chunk_pool_new(size_t num, int p, size_t cell, int batch, void **mem) {
+    size_t size = chunk_size(p, cell, batch);
+    size_t lead = chunk_aligned(cell) ? CHUNK_ALIGN - offsetof(Chunk, data) : 0;
+    char *pool = aligned_alloc(CHUNK_ALIGN, ROUNDUP(lead + num * size, CHUNK_ALIGN));
+    assert(pool != NULL);
+    for (size_t k = 0; k < num; ++k)
+        chunk_init((Chunk *)(pool + lead + k * size), p, cell, batch);
+    *mem = pool;
+    return (Chunk *)(pool + lead);
+}
+
+/**
+ * chunk_stage() - 获取 chunk 的中转区
+ *
+ * 中转区中的数据按磁盘文件中的布局存放，大小为 batch 个 raw chunk。
+ */
+static Packet *chunk_stage(Chunk *chunk) {
+    size_t num = (chunk->p + 2) * (chunk->p - 1) + CHUNK_SCRATCH(chunk->p);
+    return chunk->data + CHUNK_WIDTH(chunk) * num;
+}
+
+/**
+ * copy_cells() - 复制 count 个单元，每个单元 w 个 Packet
+ *
+ * @dstride @sstride - 目标和源中相邻两个单元的距离（以 Packet 计）
+ */
+static void copy_cells(Packet *dst, size_t dstride, const Packet *src, size_t sstride,
+        size_t count, size_t w) {
+    if (w == 1) {
+        for (size_t k = 0; k < count; ++k)
+            dst[k * dstride] = src[k * sstride];
+    } else {
+        for (size_t k = 0; k < count; ++k)
+            PASGNN(dst + k * dstride, src + k * sstride, w);
+    }
+}
+
+/**
+ * scatter_cells() - 将 buf 中按文件布局存放的单元分散到交错布局中
+ *
+ * buf 中依次存放着 num 个 chunk 编号从 first 开始的 count 个单元。
+ */
+static void scatter_cells(Chunk *chunk, size_t first, size_t count, const Packet *buf) {
+    size_t w = chunk->cell;
+    size_t stride = CHUNK_WIDTH(chunk);
+    Packet *dst = chunk->data + first * stride;
+    for (int n = 0; n < chunk->num; ++n)
+        copy_cells(dst + n * w, stride, buf + n * count * w, w, count, w);
+}
+
+/**
+ * gather_cells() - 与 scatter_cells() 相反，将交错布局中的单元按文件布局收集到 buf
+ */
+static void gather_cells(Chunk *chunk, size_t first, size_t count, Packet *buf) {
+    size_t w = chunk->cell;
+    size_t stride = CHUNK_WIDTH(chunk);
+    const Packet *src = CHUNK_CELL(chunk, first);
+    for (int n = 0; n < chunk->num; ++n)
+        copy_cells(buf + n * count * w, w, src + n * w, stride, count, w);
 }
 
-void check_chunk_(Chunk *chunk) {
+/**
+ * read_cells() - 从 file 中读取各个 chunk 编号从 first 开始的 count 个单元
+ *
+ * @stage - 中转区，至少能容纳 num * count 个单元，batch 为 1 时不使用
+ *
+ * 文件中依次存放着 num 个 chunk 的这些单元，一次读入，返回读到的字节数。文件
+ * 中的数据不足时，其余部分置零。
+ *
+ * batch 为 1 时直接读入矩阵，否则先读入中转区，再分散到交错布局中的各个切片。
+ */
+static size_t read_cells(Chunk *chunk, size_t first, size_t count, MMIO *file, Packet *stage) {
+    size_t w = chunk->cell;
+    size_t stride = CHUNK_WIDTH(chunk);
+    size_t bytes = sizeof(Packet) * w * count * chunk->num;
+    Packet *dst = chunk->data + first * stride;
+    Packet *buf = chunk->batch == 1 ? dst : stage;
+
+    size_t ok = mmread(buf, bytes, file);
+    memset((char *)buf + ok, 0, bytes - ok);
+    if (buf != dst)
+        scatter_cells(chunk, first, count, buf);
+    return ok;
+}
+
+/**
+ * write_cells() - 将各个 chunk 编号从 first 开始的 count 个单元写入 file
+ *
+ * @stage - 同 read_cells()
+ *
+ * batch 大于 1 时先按文件中的布局把 num 个 chunk 的单元收集到中转区，再一次写
+ * 入。chunk 很小时，每个 chunk 单独写入的开销远大于写入本身。
+ */
+static void write_cells(Chunk *chunk, size_t first, size_t count, MMIO *file, Packet *stage) {
+    Packet *buf = CHUNK_CELL(chunk, first);
+
+    if (chunk->batch != 1) {
+        buf = stage;
+        gather_cells(chunk, first, count, buf);
+    }
+    mmwrite(buf, sizeof(Packet) * chunk->cell * count * chunk->num, file);
+}
+
+/**
+ * check_chunk_() - 检查 Chunk 的合法性，合法时返回 0
+ *
+ * 会覆盖 chunk 的临时单元。
+ */
+int check_chunk_(Chunk *chunk) {
     assert(chunk != NULL);
 
     int m = chunk->p;
+    size_t w = CHUNK_WIDTH(chunk);
+    Packet *S = SCRATCH(0);
+    Packet *S1 = SCRATCH(1);
 
     /* 检查对角线是否合法 */
-    Packet S;
-    PZERO(S);
+    PZERON(S, w);
     for (int t = 1; t <= m - 1; ++t)
-        PXOR(S, ATR(m - 1 - t, t));
+        PXORN(S, AT(m - 1 - t, t), w);
     for (int i = 0; i <= m - 2; ++i) {
-        Packet S1;
-        PASGN(S1, ATR(i, m + 1));
+        PASGNN(S1, AT(i, m + 1), w);
         for (int j = 0; j <= m - 1; ++j) {
-            PXOR(S1, ATR(M(i - j), j));
+            if (M(i - j) != m - 1)
+                PXORN(S1, AT(M(i - j), j), w);
         }
-        if (S1 != S) {
+        if (memcmp(S1, S, w * sizeof(Packet)) != 0) {
             fprintf(stderr, "check chunk: diagonal %d/%d broken\n", i, m - 1);
-            return;
+            return -1;
         }
     }
 
     /* 检查各行异或值是否正确 */
-    PZERO(S);
     for (int i = 0; i <= m - 2; ++i) {
+        PZERON(S, w);
         for (int j = 0; j <= m; ++j) {
-            PXOR(S, ATR(i, j));
+            PXORN(S, AT(i, j), w);
         }
-        if (S != 0) {
-            fprintf(stderr, "check chunk: row %d/%d broken\n", i, m - 1);
-            return;
+        for (size_t k = 0; k < w; ++k) {
+            if (S[k] != 0) {
+                fprintf(stderr, "check chunk: row %d/%d broken\n", i, m - 1);
+                return -1;
+            }
         }
     }
+    return 0;
 }
 
 /**
  * write_raw_chunk_limited() - 将 raw chunk 写入文件，并且限制写入长度
  *
- * 原始文件大小经常不能被 p * (p-1) 整除，导致最后一个 chunk 通常不会全为有效
+ * 原始文件大小经常不能被 chunk 大小整除，导致最后一个 chunk 通常不会全为有效
  * 数据。此函数用于处理原始文件的最后一个 chunk，仅写入有效数据的部分。有效数
  * 据的大小由调用者根据其他信息计算。
+ *
+ * 仅用于 batch 为 1 的 chunk。
  */
 void write_raw_chunk_limited(Chunk *chunk, MMIO file[1], int limit) {
     assert(chunk != NULL);
+    assert(chunk->batch == 1);
     mmwrite(chunk->data, limit, &file[0]);
 }
 
 /**
  * write_raw_chunk() - 将 raw chunk 写入文件
+ *
+ * 依次写入 chunk 中的 num 个 raw chunk。
  */
 void write_raw_chunk(Chunk *chunk, MMIO file[1], UNUSED_PARAM int _unused[1]) {
     assert(chunk != NULL);
-    size_t num = chunk->p * (chunk->p - 1);
-    mmwrite(chunk->data, sizeof(Packet) * num, &file[0]);
+    size_t count = chunk->p * (chunk->p - 1);
+    write_cells(chunk, 0, count, &file[0], chunk_stage(chunk));
 }
 
 /**
  * read_raw_chunk() - 读取文件的部分字节到 chunk
  *
- * 该函数会尝试读取尽可能多的数据到 chunk 中。
+ * 该函数会尝试读取尽可能多的数据到 chunk 中，依次填满 chunk 中的 num 个 raw
+ * chunk。
  *
- * 原始文件大小经常不能被 p * (p-1) 整除，导致最后一个 chunk 通常不能读取到足
+ * 原始文件大小经常不能被 chunk 大小整除，导致最后一个 chunk 通常不能读取到足
  * 够的数据。此处我们约定，未完全填满的 chunk 其余字节皆为 0。
+ *
+ * batch 为 1 且文件被映射到内存中时，不复制数据，而是让 chunk->raw 直接指向映
+ * 射中的数据。映射是只读的，之后只能对 chunk 进行编码，不能修复原始数据列。
  */
 void read_raw_chunk(Chunk *chunk, MMIO *file) {
     assert(chunk != NULL);
-    size_t num = chunk->p * (chunk->p - 1);
-    size_t ok = mmread(chunk->data, sizeof(Packet) * num, &file[0]);
-    memset((char *)chunk->data + ok, 0, (chunk->p - 1) * (chunk->p + 2) * sizeof(Packet) - ok);
+    size_t count = chunk->p * (chunk->p - 1);
+    chunk->raw = chunk->data;
+
+    if (chunk->batch == 1) {
+        size_t bytes = sizeof(Packet) * chunk->cell * count, len;
+        const void *view = mmview(bytes, &file[0], &len);
+        if (view != NULL) {
+            if (len == bytes) {
+                chunk->raw = (Packet *)view;
+            } else {
+                memcpy(chunk->data, view, len);
+                memset((char *)chunk->data + len, 0, bytes - len);
+            }
+            return;
+        }
+    }
+    read_cells(chunk, 0, count, &file[0], chunk_stage(chunk));
+}
+
+/**
+ * read_raw_chunk_stream() - 从管道等不能映射、长度未知的文件中读取 raw chunk
+ *
+ * 直接对 file->fd 调用 read()，直到读满 num 个 raw chunk 或遇到文件末尾，然后
+ * 把 num 改为实际读到数据的 chunk 数量，为 0 即已经没有数据。file->pos 累计读
+ * 到的字节数。与 read_raw_chunk() 一样，未填满的部分置零。
+ */
+void read_raw_chunk_stream(Chunk *chunk, MMIO *file) {
+    assert(chunk != NULL);
+    size_t count = chunk->p * (chunk->p - 1);
+    size_t raw = sizeof(Packet) * chunk->cell * count;
+    size_t bytes = raw * chunk->num;
+    Packet *buf = chunk->batch == 1 ? chunk->data : chunk_stage(chunk);
+
+    chunk->raw = chunk->data;
+    size_t ok = stream_read(buf, bytes, file);
+    memset((char *)buf + ok, 0, bytes - ok);
+    chunk->num = (ok + raw - 1) / raw;
+    if (buf != chunk->data)
+        scatter_cells(chunk, 0, count, buf);
+}
+
+/**
+ * write_raw_chunk_stream() - 将 raw chunk 写入管道等不能映射的文件
+ *
+ * 与 write_raw_chunk() 相同，但直接对 file->fd 调用 write()。写到 file->size 为
+ * 止，所以最后一个 chunk 中多余的部分会被自动丢弃。
+ */
+void write_raw_chunk_stream(Chunk *chunk, MMIO file[1], UNUSED_PARAM int _unused[1]) {
+    assert(chunk != NULL);
+    size_t count = chunk->p * (chunk->p - 1);
+    size_t bytes = sizeof(Packet) * chunk->cell * count * chunk->num;
+    Packet *buf = chunk->data;
+    if (chunk->batch != 1) {
+        buf = chunk_stage(chunk);
+        gather_cells(chunk, 0, count, buf);
+    }
+    stream_write(buf, bytes, &file[0]);
+}
+
+/**
+ * write_cooked_column() - 将 chunk 的第 column 列写入对应的磁盘
+ *
+ * @stage - 中转区，至少能容纳 num * (p-1) 个单元。由调用者提供，使得多个线程
+ *          可以同时写入同一个 chunk 的不同列。
+ */
+void write_cooked_column(Chunk *chunk, int column, MMIO *file, Packet *stage) {
+    size_t cells_per_disk = chunk->p - 1;
+    write_cells(chunk, column * cells_per_disk, cells_per_disk, file, stage);
+}
+
+/**
+ * read_cooked_column() - 从对应的磁盘读取 chunk 的第 column 列
+ *
+ * @stage - 同 write_cooked_column()
+ *
+ * 调用者应保证磁盘文件有效。
+ */
+void read_cooked_column(Chunk *chunk, int column, MMIO *file, Packet *stage) {
+    size_t cells_per_disk = chunk->p - 1;
+    size_t ok = read_cells(chunk, column * cells_per_disk, cells_per_disk, file, stage);
+    assert(ok == cells_per_disk * chunk->cell * chunk->num * sizeof(Packet));
 }
 
 /**
@@ -126,15 +358,11 @@ void read_raw_chunk(Chunk *chunk, MMIO *file) {
 void write_cooked_chunk(Chunk *chunk, MMIO *files, UNUSED_PARAM int _unused[1]) {
     assert(chunk != NULL);
     int disk_num = chunk->p + 2;
-    int items_per_disk = chunk->p - 1;
-    Packet *data = chunk->data;
 #ifdef CHECKCHUNK
     check_chunk(chunk);
 #endif
-    for (int i = 0; i < disk_num; ++i) {
-        mmwrite(data, sizeof(Packet) * items_per_disk, &files[i]);
-        data += items_per_disk;
-    }
+    for (int i = 0; i < disk_num; ++i)
+        write_cooked_column(chunk, i, &files[i], chunk_stage(chunk));
 }
 
 /**
@@ -150,15 +378,12 @@ void write_cooked_chunk(Chunk *chunk, MMIO *files, UNUSED_PARAM int _unused[1])
  */
 void write_cooked_chunk_to_bad_disk(Chunk *chunk, MMIO bad_disk_fp[2], int bad_disks[2]) {
     assert(chunk != NULL);
-    int items_per_disk = chunk->p - 1;
-    Packet *data = chunk->data;
 #ifdef CHECKCHUNK
     check_chunk(chunk);
 #endif
     for (int i = 0; i < 2; ++i) {
-        if (bad_disks[i] != -1) {
-            mmwrite(data + items_per_disk * bad_disks[i], sizeof(Packet) * items_per_disk, &bad_disk_fp[i]);
-        }
+        if (bad_disks[i] != -1)
+            write_cooked_column(chunk, bad_disks[i], &bad_disk_fp[i], chunk_stage(chunk));
     }
 }
 
@@ -174,16 +399,12 @@ void write_cooked_chunk_to_bad_disk(Chunk *chunk, MMIO bad_disk_fp[2], int bad_d
 void read_cooked_chunk(Chunk *chunk, MMIO files[]) {
     assert(chunk != NULL);
     int disk_num = chunk->p + 2;
-    int items_per_disk = chunk->p - 1;
-    Packet *data = chunk->data;
+    size_t cells_per_disk = chunk->p - 1;
 
     for (int i = 0; i < disk_num; ++i) {
-        if (files[i].fd == -1) {
-            memset(data, 0, items_per_disk * sizeof(Packet));
-        } else {
-            size_t ok = mmread(data, sizeof(Packet) * items_per_disk, &files[i]);
-            assert(ok == items_per_disk * sizeof(Packet));
-        }
-        data += items_per_disk;
+        if (files[i].fd == -1)
+            PZERON(AT(0, i), cells_per_disk * CHUNK_WIDTH(chunk));
+        else
+            read_cooked_column(chunk, i, &files[i], chunk_stage(chunk));
     }
 }
@@ -6,12 +6,29 @@
 #include "util.h"
 #include "mmio/mmio.h"
 
+/**
+ * CHUNK_ALIGN - chunk 池中 data 的对齐字节数
+ *
+ * 单元不小于 CHUNK_ALIGN 时，磁盘文件中的每个 record 和原始文件中的每个 raw
+ * chunk 都从对齐的位置开始，长度也是对齐的。此时 chunk_pool_new() 让每个 Chunk
+ * 的 data 也对齐，使用 O_DIRECT 的 MMIO 实现（见 mmio-direct.c）就可以直接在
+ * data 与磁盘之间传输，不必经过自己的缓冲区。单元更小时反正要经过缓冲区，不做
+ * 对齐，以免浪费内存。
+ */
+#define CHUNK_ALIGN (4096)
+
 /**
  * Chunk - 实现校验与恢复功能的基本单位。
  *
  * @p - Chunk 所使用的质数
- * @data - Chunk 保存数据所使用的空间，是零长数组，共有 (p+2) * (p-1) 项，
- *         是 p+2 行 p-1 列的 Packet 矩阵。
+ * @ok - 是否已经完成校验或修复
+ * @batch - 交错存放在一起的 chunk 数量
+ * @num - 其中实际装有数据的 chunk 数量，不超过 batch
+ * @cell - 单个 chunk 中每个单元所包含的 Packet 数量
+ * @raw - 前 p 列（即 raw chunk）所在的位置，通常就是 data
+ * @data - Chunk 保存数据所使用的空间，是零长数组。前 (p+2) * (p-1) 个单元是
+ *         p+2 行 p-1 列的单元矩阵，之后的 CHUNK_SCRATCH(p) 个单元是计算时使用
+ *         的临时空间。batch 大于 1 时，再之后是读写磁盘时使用的中转区。
  *
  * Chunk 分为两种，分别为 raw chunk 和 cooked chunk。raw chunk 为原始数据，两
  * 个冗余列并未包括其中。cooked chunk 同时包含原始数据和冗余列，有效数据的大小
@@ -22,33 +39,77 @@
  * raw chunk 与 cooked chunk 之间的转换会经常进行，而两者有大量可复用的数据。
  * 为减少内存分配，降低内存管理难度以及优化性能，选择这种实现方法。
  *
- * 对于 raw chunk 来说，将 data 视为一维数组，取其前 sizeof(Packet) * p * (p-1)
- * 个字节即为原始文件的部分内容。对于 cooked chunk 来说，将 data 视为 (p+2) 行
- * 的二维数组，每行长度为 sizeof(Packet) * (p-1) 。第 i 行即为编号为 i 的磁盘中
- * 所保存的内容。
+ * 对于 raw chunk 来说，将 data 视为一维数组，取其前 cell * p * (p-1) 个 Packet
+ * 即为原始文件的部分内容。对于 cooked chunk 来说，将 data 视为 (p+2) 行的二维
+ * 数组，每行长度为 cell * (p-1) 个 Packet 。第 i 行即为编号为 i 的磁盘中所保存
+ * 的内容。
  *
  * 原始论文中，类似 Chunk 中 data 的结构被描述为 p-1 行 p+2 列的矩阵。为了获得
  * “cooked chunk 开头一块内存即为其对应的 raw chunk” 这一性质，我们对矩阵进行
  * 了一次转置。所以 data 应被解释为 p+2 行 p-1 列的矩阵。
  *
+ * 论文中矩阵的每个元素是一个比特，我们将其推广为 cell 个连续的 Packet 组成的
+ * 单元。单元越大，每次异或处理的连续内存越长，每个磁盘的 record 也越大。
+ *
  * 在结构体中使用零长数组，是为了方便内存管理和 Chunk 复制。除此之外，此处零长
  * 数组与指针相比并无优势。
  *
  * 零长数组导致 Chunk 的大小无法在编译时知晓。所以对 Chunk 的操作均应使用指向
  * chunk 的指针进行。
+ *
+ * 一个 Chunk 结构体可以按交错布局（SoA）同时存放 batch 个逻辑上的 chunk：矩阵中
+ * 每个单元由 batch 个 cell 大小的切片组成，第 n 片属于第 n 个 chunk。由于所有
+ * chunk 对同一单元所做的运算完全相同，把这 batch 片看作一个宽度为
+ * CHUNK_WIDTH(chunk) 的单元，调度表和内核无需任何修改，就能一次处理 batch 个
+ * chunk：每次异或的长度变为原来的 batch 倍，对角线递推中前后依赖的每一步也都有
+ * 足够多相互独立的 Packet 可以并行处理。batch 为 1 时即为普通的 chunk。
+ *
+ * 交错布局只存在于内存中，磁盘文件与原始文件的格式不变。读写时通过中转区在两
+ * 种布局之间转换。
+ *
+ * 编码时原始数据只读不写。若原始文件被映射到内存中，read_raw_chunk() 会让 raw
+ * 直接指向映射中的数据而不复制，此时只有两个校验列和临时单元位于 data 中。所
+ * 以访问单元应通过 AT() 或 CHUNK_CELL()，不应直接根据 data 计算地址。
  */
 typedef struct Chunk {
     int p;
     int ok;
+    int batch;
+    int num;
+    size_t cell;
+    Packet *raw;
     Packet data[];
 } Chunk;
 
+/**
+ * CHUNK_WIDTH() - 交错布局下矩阵中一个单元所包含的 Packet 数量
+ */
+#define CHUNK_WIDTH(chunk) ((chunk)->cell * (size_t)(chunk)->batch)
+
+/**
+ * CHUNK_CELL() - 获取编号为 k 的单元
+ *
+ * 编号即单元在矩阵中的下标：第 col 列第 row 行的单元编号为 col * (p-1) + row，
+ * 临时单元紧随矩阵之后。前 p * (p-1) 个单元位于 raw 中，其余位于 data 中。
+ */
+#define CHUNK_CELL(chunk, k) \
+    (((size_t)(k) < (size_t)(chunk)->p * ((chunk)->p - 1) ? (chunk)->raw : (chunk)->data) \
+     + (size_t)(k) * CHUNK_WIDTH(chunk))
+
+/**
+ * CHUNK_SCRATCH() - 计算时所需的临时单元数量
+ *
+ * 修复两块原始数据磁盘时需要 p-1 个行校验子、p 个对角线校验子和 1 个调整因子。
+ */
+#define CHUNK_SCRATCH(p) (2 * (p) + 1)
+
 
-Chunk *chunk_init(Chunk *chunk, int p);
-size_t chunk_size(int p);
-size_t chunk_data_size(int p);
-Chunk *chunk_new(int p);
-void check_chunk_(Chunk *chunk);
+Chunk *chunk_init(Chunk *chunk, int p, size_t cell, int batch);
+size_t chunk_size(int p, size_t cell, int batch);
+size_t chunk_data_size(int p, size_t cell);
+Chunk *chunk_new(int p, size_t cell, int batch);
+Chunk *chunk_pool_new(size_t num, int p, size_t cell, int batch, void **mem);
+int check_chunk_(Chunk *chunk);
 
 /**
  * check_chunk() - 检查 Chunk 的合法性
@@ -59,42 +120,45 @@ void check_chunk_(Chunk *chunk);
  * 该函数应该仅在 DEBUG 模式下使用，以测试算法的正确性。
  */
 #define check_chunk(chunk) do { \
-    if (check_chunk_(chunk) != Success) { \
+    if (check_chunk_(chunk) != 0) { \
         fprintf(stderr, "check_chunk() failed at line %d\n", __LINE__); \
         abort(); \
     } \
 } while (0)
 
 void read_cooked_chunk(Chunk *chunk, MMIO files[]);
+void read_cooked_column(Chunk *chunk, int column, MMIO *file, Packet *stage);
+void write_cooked_column(Chunk *chunk, int column, MMIO *file, Packet *stage);
 void read_raw_chunk(Chunk *chunk, MMIO *file);
+void read_raw_chunk_stream(Chunk *chunk, MMIO *file);
 void write_cooked_chunk(Chunk *chunk, MMIO *files, UNUSED_PARAM int _unused[1]);
 void write_cooked_chunk_to_bad_disk(Chunk *chunk, MMIO bad_disk_fp[2], int bad_disks[2]);
 void write_raw_chunk(Chunk *chunk, MMIO file[1], UNUSED_PARAM int _unused[1]);
 void write_raw_chunk_limited(Chunk *chunk, MMIO file[1], int limit);
+void write_raw_chunk_stream(Chunk *chunk, MMIO file[1], UNUSED_PARAM int _unused[1]);
 
 /**
- * AT() - 获取 chunk 中 data 矩阵的某行某列
+ * AT() - 获取 chunk 中 data 矩阵某行某列的单元
  * @row - 行号
  * @column - 列号
  *
- * 计算结果为左值。
+ * 计算结果为指向该单元第一个 Packet 的指针。同一列中相邻行的单元在内存中是连
+ * 续的，所以 AT(row, column) 开始的 n * CHUNK_WIDTH(chunk) 个 Packet 即为该列从
+ * row 开始的 n 个单元。
  *
  * 为了方便抄论文，此处的行与列为论文中的原始矩阵的行和列，而不是实际上存储的
  * 转置后的矩阵的行和列。计算过程中，会自动完成由原始矩阵行列到实际矩阵行列的
  * 转换。
+ *
+ * 论文中临时给矩阵多加了全零的一行，以方便描述算法。其规定第 p-1 行的所有元素
+ * 皆为零。该行并不实际存储，调用者应自行跳过。
  */
-#define AT(row, column) (chunk->data[(column) * (chunk->p - 1) + (row)])
+#define AT(row, column) \
+    CHUNK_CELL(chunk, (size_t)(column) * (chunk->p - 1) + (size_t)(row))
 
 /**
- * ATR() - 获取 chunk 中 data 矩阵的某行某列
- *
- * 计算结果为右值。
- *
- * 论文中临时给矩阵多加了全零的一行，以方便描述算法。其规定第 p-1 行的所有元素
- * 皆为零。此时如果使用 AT() 宏会出现非法内存访问的错误，因此应当使用 ATR() 进
- * 行计算。在 row < p-1 时，行为与 AT() 一致。
+ * SCRATCH() - 获取 chunk 中第 k 个临时单元
  */
-#define ATR(row, column) (((row) == (chunk->p - 1)) ? 0 \
-        : (chunk->data[(column) * (chunk->p - 1) + (row)]))
+#define SCRATCH(k) AT(k, chunk->p + 2)
 
 #endif
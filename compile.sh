@@ -1,6 +1,6 @@
 #!/bin/bash
 
-gcc mmio/mmio-mixed.c spsc/spsc.c evenodd.c chunk.c metadata.c repair.c \
+gcc mmio/mmio-mixed.c spsc/spsc.c evenodd.c chunk.c metadata.c repair.c simd.c kernel.c diskio.c prefetch.c range.c pack.c catalog.c \
     -O2 \
     -pthread \
     -std=gnu11 \
@@ -19,7 +19,7 @@ gcc mmio/mmio-mixed.c spsc/spsc.c evenodd.c chunk.c metadata.c repair.c \
     -Wredundant-decls -Wold-style-definition
 exit 0
 
-gcc mmio/mmio-pipe.c spsc/spsc.c evenodd.c chunk.c metadata.c repair.c \
+gcc mmio/mmio-pipe.c spsc/spsc.c evenodd.c chunk.c metadata.c repair.c simd.c kernel.c diskio.c prefetch.c range.c pack.c catalog.c \
     -Og -g -fsanitize=address \
     -pthread \
     -std=gnu11 \
@@ -0,0 +1,177 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "diskio.h"
+
+/**
+ * DISKBATCH - 磁盘线程一次最多取走的 chunk 数量
+ *
+ * 每处理完一个 chunk 仍然立即更新 done，成批取走只是减少与提交方的同步。
+ */
+#define DISKBATCH (8)
+
+/**
+ * DISK_SPIN_LIMIT - 等待磁盘线程时，开始让出 CPU 前空转的次数
+ * DISK_YIELD_LIMIT - 等待磁盘线程时，开始睡眠前让出 CPU 的次数
+ *
+ * 与 SpscQueue 的自适应等待相同。磁盘线程往往在做 I/O，一直空转会白白占满一个
+ * 核，修复多个文件时这样的等待者多达几十个。
+ */
+#define DISK_SPIN_LIMIT (1024)
+#define DISK_YIELD_LIMIT (64)
+
+/**
+ * disk_done() - 磁盘线程处理完第 k 个 chunk，在等待者睡眠时唤醒它
+ *
+ * 与 diskset_wait() 中的等待配对，道理同 spsc.c 中的 publish()。
+ */
+static void disk_done(DiskIO *disk, size_t k) {
+    __atomic_store_n(&disk->done, (unsigned int)k, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&disk->parked, __ATOMIC_RELAXED))
+        syscall(SYS_futex, &disk->done, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * disk_ready() - 磁盘线程是否处理完了第 completed 个 chunk（从 0 开始）
+ */
+static int disk_ready(DiskIO *disk, size_t completed) {
+    return __atomic_load_n(&disk->done, __ATOMIC_ACQUIRE) != (unsigned int)completed;
+}
+
+static void *disk_thread(void *data) {
+    DiskIO *disk = (DiskIO *)data;
+    ItemType chunks[DISKBATCH];
+    for (size_t k = 0; k < disk->times; ) {
+        size_t left = disk->times - k;
+        unsigned int n = SpscQueue_pop_n(&disk->todo, chunks, left < DISKBATCH ? left : DISKBATCH);
+        for (unsigned int t = 0; t < n; ++t) {
+            /* diskset_stop() 提前结束 */
+            if (chunks[t] == NULL)
+                pthread_exit(NULL);
+            disk->io(chunks[t], disk->column, disk->file, disk->stage);
+            disk_done(disk, ++k);
+        }
+    }
+    pthread_exit(NULL);
+}
+
+/**
+ * diskset_start() - 为每个磁盘启动一个 I/O 线程
+ *
+ * @files @columns - 第 k 个线程负责将 columns[k] 列读出或写入 files[k]
+ * @num - 磁盘数量
+ * @times - 将要提交的 chunk 数量
+ * @size - 同时在处理中的 chunk 的最大数量，通常为 chunk 池的大小
+ * @stage - 每个线程的中转区大小（以 Packet 计）
+ */
+void diskset_start(DiskSet *set, ColumnIO io, MMIO *files[], const int columns[], int num,
+        size_t times, unsigned int size, size_t stage) {
+    set->num = num;
+    set->disks = calloc(num, sizeof(DiskIO));
+    assert(set->disks != NULL);
+    set->mask = 1;
+    while (set->mask < size)
+        set->mask *= 2;
+    set->ring = malloc(set->mask * sizeof(Chunk *));
+    assert(set->ring != NULL);
+    set->mask -= 1;
+    set->submitted = 0;
+    set->completed = 0;
+
+    for (int k = 0; k < num; ++k) {
+        DiskIO *disk = &set->disks[k];
+        disk->io = io;
+        disk->column = columns[k];
+        disk->file = files[k];
+        disk->stage = aligned_alloc(CHUNK_ALIGN, ROUNDUP(stage * sizeof(Packet), CHUNK_ALIGN));
+        assert(disk->stage != NULL);
+        disk->todo = SpscQueue_new(size);
+        disk->done = 0;
+        disk->parked = 0;
+        disk->times = times;
+        pthread_create(&disk->tid, NULL, disk_thread, disk);
+    }
+}
+
+/**
+ * diskset_submit() - 将 chunk 交给所有磁盘线程
+ */
+void diskset_submit(DiskSet *set, Chunk *chunk) {
+    assert(diskset_pending(set) <= set->mask);
+    set->ring[set->submitted & set->mask] = chunk;
+    set->submitted += 1;
+    for (int k = 0; k < set->num; ++k)
+        SpscQueue_push(&set->disks[k].todo, chunk);
+}
+
+/**
+ * diskset_poll() - 取回最早提交的 chunk
+ *
+ * 没有已提交的 chunk，或者最早提交的 chunk 还有磁盘没处理完时，返回 NULL。
+ */
+Chunk *diskset_poll(DiskSet *set) {
+    if (diskset_pending(set) == 0)
+        return NULL;
+    for (int k = 0; k < set->num; ++k) {
+        if (!disk_ready(&set->disks[k], set->completed))
+            return NULL;
+    }
+    return set->ring[set->completed++ & set->mask];
+}
+
+/**
+ * diskset_wait() - 等待并取回最早提交的 chunk
+ *
+ * 没有已提交的 chunk 时返回 NULL。
+ *
+ * 依次等待每个磁盘线程处理完这个 chunk：先空转一小会，再让出 CPU 若干次，最后
+ * 在该线程的 done 上睡眠，直到它更新 done 时唤醒。先置 parked 再检查 done，
+ * 与 disk_done() 先改 done 再检查 parked 配对，不会错过唤醒。
+ */
+Chunk *diskset_wait(DiskSet *set) {
+    if (diskset_pending(set) == 0)
+        return NULL;
+    for (int k = 0; k < set->num; ++k) {
+        DiskIO *disk = &set->disks[k];
+        unsigned int val = (unsigned int)set->completed;
+        for (unsigned int n = 0; !disk_ready(disk, set->completed); ++n) {
+            if (n < DISK_SPIN_LIMIT) {
+                cpu_relax();
+            } else if (n < DISK_SPIN_LIMIT + DISK_YIELD_LIMIT) {
+                sched_yield();
+            } else {
+                __atomic_store_n(&disk->parked, 1, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (!disk_ready(disk, set->completed))
+                    syscall(SYS_futex, &disk->done, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+                __atomic_store_n(&disk->parked, 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return set->ring[set->completed++ & set->mask];
+}
+
+/**
+ * diskset_stop() - 等待所有磁盘线程结束，并释放资源
+ *
+ * 提交的 chunk 可以少于 diskset_start() 时约定的数量（例如数量事先未知，times
+ * 只是上限），但都应已取回。此时向各个线程发送 NULL 让其提前结束。
+ */
+void diskset_stop(DiskSet *set) {
+    assert(diskset_pending(set) == 0);
+    for (int k = 0; k < set->num; ++k) {
+        if (set->submitted < set->disks[k].times)
+            SpscQueue_push(&set->disks[k].todo, NULL);
+        pthread_join(set->disks[k].tid, NULL);
+        SpscQueue_drop(&set->disks[k].todo);
+        free(set->disks[k].stage);
+    }
+    free(set->disks);
+    free(set->ring);
+}
@@ -0,0 +1,80 @@
+#ifndef DISKIO_H_
+#define DISKIO_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include "spsc/spsc.h"
+#include "mmio/mmio.h"
+#include "packet.h"
+#include "chunk.h"
+
+/**
+ * ColumnIO - 读取或写入 chunk 中的一列
+ *
+ * 即 read_cooked_column() 或 write_cooked_column()。
+ */
+typedef void (*ColumnIO)(Chunk *chunk, int column, MMIO *file, Packet *stage);
+
+/**
+ * DiskIO - 负责一个磁盘的 I/O 线程
+ *
+ * @column - 该线程负责的列，即磁盘编号
+ * @file - 该磁盘中的文件
+ * @stage - 该线程私有的中转区
+ * @todo - 等待该线程处理的 chunk
+ * @done - 已经处理完的 chunk 数量（模 2^32），由该线程写入，其他线程只读。
+ *         兼作 futex，该线程每次更新后在 parked 置位时唤醒等待者
+ * @parked - 等待者是否在 done 上睡眠，见 diskset_wait()
+ * @times - 该线程需要处理的 chunk 数量，或者其上限，见 diskset_stop()
+ */
+typedef struct DiskIO {
+    ColumnIO io;
+    int column;
+    MMIO *file;
+    Packet *stage;
+    SpscQueue todo;
+    unsigned int done;
+    int parked;
+    size_t times;
+    pthread_t tid;
+} DiskIO;
+
+/**
+ * DiskSet - 一组并行工作的磁盘 I/O 线程
+ *
+ * @num - 磁盘数量
+ * @disks - 各个磁盘的 I/O 线程
+ * @ring - 已经提交但尚未取回的 chunk，按提交顺序排列
+ * @mask - ring 的长度减一，长度为 2 的幂
+ * @submitted - 已经提交的 chunk 数量
+ * @completed - 已经取回的 chunk 数量
+ *
+ * 每个 chunk 都会交给所有的磁盘线程，各自处理自己的那一列。只有所有磁盘线程
+ * 都处理完时，chunk 才算完成。由于各个磁盘线程都按提交顺序处理，只需比较每个
+ * 线程的 done 计数就能知道最早提交的 chunk 是否完成，chunk 也按提交顺序取回。
+ * 处理中的 chunk 不超过 ring 的长度，done 只保留低 32 位也不会混淆。
+ *
+ * 提交和取回必须在同一个线程中进行。
+ */
+typedef struct DiskSet {
+    int num;
+    DiskIO *disks;
+    Chunk **ring;
+    size_t mask;
+    size_t submitted;
+    size_t completed;
+} DiskSet;
+
+void diskset_start(DiskSet *set, ColumnIO io, MMIO *files[], const int columns[], int num,
+        size_t times, unsigned int size, size_t stage);
+void diskset_submit(DiskSet *set, Chunk *chunk);
+Chunk *diskset_poll(DiskSet *set);
+Chunk *diskset_wait(DiskSet *set);
+void diskset_stop(DiskSet *set);
+
+/**
+ * diskset_pending() - 已经提交但尚未取回的 chunk 数量
+ */
+#define diskset_pending(set) ((set)->submitted - (set)->completed)
+
+#endif
@@ -0,0 +1,146 @@
+/**
+ * kernel-tmpl.h - 针对某个质数特化的编码与修复内核
+ *
+ * 本文件没有 include guard，由 kernel.c 在定义 KP 为某个质数之后多次包含，每次
+ * 生成一个名为 kernel_KP() 的函数。函数中所有循环的边界都是编译期常量，编译器
+ * 可以将其完全展开，下标计算也全部变为常量。
+ *
+ * 与调度表按列多次扫描整个 chunk 不同，这里按“通道”处理：单元中第 k 个 Packet
+ * 只与其他单元中第 k 个 Packet 一起运算。对一组通道，只需把 chunk 扫描一遍，同
+ * 时累加出每行和每条对角线的异或值（放在寄存器或栈上），再由它们直接算出被修
+ * 复的两列。单元较小时，这比调度表中大量的短区间运算快得多。
+ *
+ * 通道之间互不相关，按 KLANES 个一组处理，内层的定长循环便于编译器向量化。
+ */
+
+#ifndef KP
+#error "KP must be defined before including kernel-tmpl.h"
+#endif
+
+#define KCAT_(a, b) a##b
+#define KCAT(a, b) KCAT_(a, b)
+#define KFN KCAT(kernel_, KP)
+#define KGROUP KCAT(kernel_group_, KP)
+
+/**
+ * KAT() - 当前通道组中第 row 行第 col 列单元的第 l 个 Packet
+ *
+ * 前 KP 列位于 raw 中，其余位于 base 中，见 Chunk。
+ */
+#define KAT(row, col, l) \
+    (((col) < KP ? raw : base)[((size_t)(col) * (KP - 1) + (row)) * w + (l)])
+
+/**
+ * KGROUP() - 处理从 raw 和 base 开始的 L 个通道
+ *
+ * L 总是编译期常量，内联之后所有循环都是定长的。
+ */
+static inline __attribute__((always_inline))
+void KGROUP(Packet *raw, Packet *base, size_t w, int i, int j, const int L) {
+    Packet row[KP - 1][KLANES];
+    Packet diag[KP][KLANES];
+
+    /* row[r] 和 diag[d] 为除 i j 两列外，第 r 行和第 d 条对角线上原始数据的异或值 */
+    for (int r = 0; r < KP - 1; ++r)
+        for (int l = 0; l < L; ++l)
+            row[r][l] = 0;
+    for (int d = 0; d < KP; ++d)
+        for (int l = 0; l < L; ++l)
+            diag[d][l] = 0;
+    for (int c = 0; c < KP; ++c) {
+        if (c == i || c == j)
+            continue;
+        for (int r = 0; r < KP - 1; ++r) {
+            int d = r + c < KP ? r + c : r + c - KP;
+            for (int l = 0; l < L; ++l) {
+                Packet x = KAT(r, c, l);
+                row[r][l] ^= x;
+                diag[d][l] ^= x;
+            }
+        }
+    }
+
+    if (i == KP && j == KP + 1) {
+        /* 损坏的是两个保存校验值的磁盘 */
+        for (int r = 0; r < KP - 1; ++r) {
+            for (int l = 0; l < L; ++l) {
+                KAT(r, KP, l) = row[r][l];
+                KAT(r, KP + 1, l) = diag[r][l] ^ diag[KP - 1][l];
+            }
+        }
+    } else if (j == KP) {
+        /* i < p，借助对角线校验恢复第 i 列，再重新计算行校验 */
+        int ref = i == 0 ? KP - 1 : i - 1;
+        for (int l = 0; l < L; ++l) {
+            /* 第 ref 条对角线不经过第 i 列，由它求出调整因子 S */
+            Packet S = ref == KP - 1 ? diag[ref][l]
+                : diag[ref][l] ^ KAT(ref, KP + 1, l);
+            for (int r = 0; r < KP - 1; ++r) {
+                int d = r + i < KP ? r + i : r + i - KP;
+                Packet q = d == KP - 1 ? 0 : KAT(d, KP + 1, l);
+                Packet x = q ^ S ^ diag[d][l];
+                KAT(r, i, l) = x;
+                KAT(r, KP, l) = row[r][l] ^ x;
+            }
+        }
+    } else if (j == KP + 1) {
+        /* i < p，借助行校验恢复第 i 列，再重新计算对角线校验 */
+        for (int r = 0; r < KP - 1; ++r) {
+            int d = r + i < KP ? r + i : r + i - KP;
+            for (int l = 0; l < L; ++l) {
+                Packet x = row[r][l] ^ KAT(r, KP, l);
+                KAT(r, i, l) = x;
+                diag[d][l] ^= x;
+            }
+        }
+        for (int r = 0; r < KP - 1; ++r)
+            for (int l = 0; l < L; ++l)
+                KAT(r, KP + 1, l) = diag[r][l] ^ diag[KP - 1][l];
+    } else {
+        /* 损坏的是两块原始数据磁盘，row 即水平方向的 syndrome */
+        for (int l = 0; l < L; ++l) {
+            Packet S = 0;
+            for (int r = 0; r < KP - 1; ++r) {
+                Packet x = KAT(r, KP, l);
+                S ^= x ^ KAT(r, KP + 1, l);
+                row[r][l] ^= x;
+            }
+            /* 对角线方向的 syndrome，就地存放在 diag 中 */
+            for (int d = 0; d < KP - 1; ++d)
+                diag[d][l] ^= S ^ KAT(d, KP + 1, l);
+            diag[KP - 1][l] ^= S;
+        }
+        int step = j - i;
+        for (int s = KP - 1 - step; s != KP - 1; s -= step) {
+            int t = s + step < KP ? s + step : s + step - KP;
+            int d = s + j < KP ? s + j : s + j - KP;
+            for (int l = 0; l < L; ++l) {
+                Packet x = diag[d][l];
+                if (t != KP - 1)
+                    x ^= KAT(t, i, l);
+                KAT(s, j, l) = x;
+                KAT(s, i, l) = row[s][l] ^ x;
+            }
+            s += KP * (s < step);
+        }
+    }
+}
+
+static void KFN(Chunk *chunk, int i, int j) {
+    assert(chunk->p == KP);
+    assert(i < j);
+    size_t w = CHUNK_WIDTH(chunk);
+    size_t g = 0;
+
+    for (; g + KLANES <= w; g += KLANES)
+        KGROUP(chunk->raw + g, chunk->data + g, w, i, j, KLANES);
+    /* 不足 KLANES 个的通道逐个处理 */
+    for (; g < w; ++g)
+        KGROUP(chunk->raw + g, chunk->data + g, w, i, j, 1);
+}
+
+#undef KAT
+#undef KGROUP
+#undef KFN
+#undef KCAT
+#undef KCAT_
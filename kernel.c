@@ -0,0 +1,68 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packet.h"
+#include "chunk.h"
+#include "kernel.h"
+
+/**
+ * KLANES - 特化内核每次同时处理的通道数
+ */
+#define KLANES (4)
+
+#define KP 7
+#include "kernel-tmpl.h"
+#undef KP
+#define KP 11
+#include "kernel-tmpl.h"
+#undef KP
+#define KP 13
+#include "kernel-tmpl.h"
+#undef KP
+#define KP 17
+#include "kernel-tmpl.h"
+#undef KP
+
+/**
+ * KERNEL_MAX_CELL - 使用特化内核的最大单元宽度（以 Packet 计）
+ *
+ * 特化内核按通道处理，每组通道要跨越 chunk 中所有单元访存，单元较宽时不如调度
+ * 表的整段运算。bench/kernel.sh 中单元为 8 字节时，p = 7 11 13 17 的特化内核比
+ * 调度表快 1.4 到 4.9 倍，也比调度表按 BATCH_BYTES 交错处理时快（p = 11 修复两
+ * 个数据列时 2455 对 1269 MB/s）；16 和 32 字节时有的情况更快、有的更慢（例如
+ * p = 7 16 字节编码时 2002 对交错的 2691 MB/s），64 字节时基本都更慢。
+ *
+ * p = 3 和 5 没有特化内核：一个 chunk 太小，交错几十个 chunk 之后调度表处理宽单
+ * 元比特化内核逐个处理 chunk 快一倍左右，64 MB 文件的写入和修复也是交错更快。
+ */
+#define KERNEL_MAX_CELL (1)
+
+static const struct {
+    int p;
+    KernelFn fn;
+} kernels[] = {
+    { 7, kernel_7 },
+    { 11, kernel_11 },
+    { 13, kernel_13 },
+    { 17, kernel_17 },
+};
+
+/**
+ * kernel_get() - 查找质数 p 的特化内核
+ *
+ * @cell - 单元宽度（以 Packet 计），交错布局时为 CHUNK_WIDTH()
+ *
+ * 没有对应的特化内核，或者单元太宽、特化内核不比调度表快时返回 NULL，调用者应
+ * 使用通用的调度表。设置环境变量 EVENODD_NOKERNEL 时总是返回 NULL。
+ */
+KernelFn kernel_get(int p, size_t cell) {
+    if (cell > KERNEL_MAX_CELL || getenv("EVENODD_NOKERNEL") != NULL)
+        return NULL;
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        if (kernels[k].p == p)
+            return kernels[k].fn;
+    }
+    return NULL;
+}
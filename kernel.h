@@ -0,0 +1,17 @@
+#ifndef KERNEL_H_
+#define KERNEL_H_
+
+#include <stddef.h>
+#include "chunk.h"
+
+/**
+ * KernelFn - 针对某个质数特化的内核
+ *
+ * 重新计算 chunk 的第 i 列和第 j 列，i < j。与 schedule_get(p, i, j) 所得调度表
+ * 的执行结果逐位一致。
+ */
+typedef void (*KernelFn)(Chunk *chunk, int i, int j);
+
+KernelFn kernel_get(int p, size_t cell);
+
+#endif
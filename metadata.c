@@ -1,71 +1,394 @@
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "metadata.h"
 #include "mmio/mmio.h"
 #include <assert.h>
 #include "packet.h"
 #include <stdlib.h>
+#include <string.h>
+
+/**
+ * CELL_MIN_CHUNKS - 自动选择单元大小时，文件至少要填满的 chunk 数量
+ *
+ * 最后一个 chunk 的填充会浪费空间，chunk 数量足够多时浪费的比例才足够小。
+ */
+#define CELL_MIN_CHUNKS (64)
+
+/**
+ * CHUNK_MAX - 自动选择单元大小时，一个 raw chunk 的最大字节数
+ */
+#define CHUNK_MAX (64 * 1024 * 1024)
+
+/**
+ * metadata_from_disk() - 解析磁盘上的 Metadata
+ *
+ * @buf - 磁盘文件开头的数据，长度至少为 sizeof(MetadataV1)，不足部分应补零
+ */
+static Metadata metadata_from_disk(const void *buf) {
+    Metadata result;
+    MetadataV1 v1;
+    memcpy(&v1, buf, sizeof(v1));
+    if (v1.magic == METADATA_MAGIC) {
+        assert(v1.version == 1 || v1.version == 2);
+        result.p = v1.p;
+        result.size = v1.size;
+        result.full_chunk_num = v1.full_chunk_num;
+        result.last_chunk_data_size = v1.last_chunk_data_size;
+        result.cell = v1.cell;
+        result.header_size = METADATA_SIZE;
+        result.rotate = v1.version == 2 ? (int)v1.rotate : 0;
+        assert(result.rotate < result.p + 2);
+    } else {
+        MetadataV0 v0;
+        memcpy(&v0, buf, sizeof(v0));
+        result.p = v0.p;
+        result.size = v0.size;
+        result.full_chunk_num = v0.full_chunk_num;
+        result.last_chunk_data_size = v0.last_chunk_data_size;
+        result.cell = sizeof(Packet);
+        result.header_size = sizeof(MetadataV0);
+        result.rotate = 0;
+    }
+    return result;
+}
 
 /**
  * skip_metadata() - 跳过文件中的 Metadata
  *
  * 调用者需要保证文件正确打开，且其中确实有 Metadata
  */
-void skip_metadata(MMIO *file) {
-    Metadata data;
+void skip_metadata(Metadata *meta, MMIO *file) {
+    char buf[METADATA_SIZE];
     assert(file != NULL);
-    mmread(&data, sizeof(data), file);
+    assert(meta->header_size <= sizeof(buf));
+    mmread(buf, meta->header_size, file);
+}
+
+/**
+ * format_metadata() - 按磁盘格式生成 Metadata，返回其字节数
+ *
+ * 按 header_size 选择格式。修复旧格式的文件时，重建的磁盘文件也必须是旧格式，
+ * 才能与其他磁盘上的 record 对齐。旧格式不能轮转。
+ */
+static size_t format_metadata(Metadata data, char buf[METADATA_SIZE]) {
+    memset(buf, 0, METADATA_SIZE);
+    if (data.header_size == sizeof(MetadataV0)) {
+        assert(data.rotate == 0);
+        MetadataV0 v0 = {
+            .p = data.p,
+            .size = data.size,
+            .full_chunk_num = data.full_chunk_num,
+            .last_chunk_data_size = data.last_chunk_data_size,
+        };
+        memcpy(buf, &v0, sizeof(v0));
+        return sizeof(v0);
+    }
+
+    MetadataV1 v1 = {
+        .magic = METADATA_MAGIC,
+        .version = data.rotate != 0 ? 2 : 1,
+        .p = data.p,
+        .cell = data.cell,
+        .size = data.size,
+        .full_chunk_num = data.full_chunk_num,
+        .last_chunk_data_size = data.last_chunk_data_size,
+        .rotate = data.rotate,
+    };
+    assert(data.header_size == METADATA_SIZE);
+    memcpy(buf, &v1, sizeof(v1));
+    return METADATA_SIZE;
 }
 
 /**
  * write_metadata() - 将 Metadata 写入文件
  */
 void write_metadata(Metadata data, MMIO *file) {
+    char buf[METADATA_SIZE];
     assert(file != NULL);
-    mmwrite(&data, sizeof(data), file);
+    mmwrite(buf, format_metadata(data, buf), file);
+}
+
+/**
+ * rewrite_metadata() - 改写已经写好的磁盘文件 path 开头的 Metadata
+ *
+ * 用于写入前不知道文件长度的情况：先写入占位的 Metadata，所有 record 写完后
+ * 再改写为最终的内容。新旧 Metadata 的 header_size 必须相同。
+ */
+void rewrite_metadata(Metadata data, const char *path) {
+    char buf[METADATA_SIZE];
+    size_t len = format_metadata(data, buf);
+    int fd = open(path, O_WRONLY);
+    assert(fd != -1);
+    ssize_t ret = pwrite(fd, buf, len, 0);
+    assert(ret == (ssize_t)len);
+    (void)ret;
+    close(fd);
+}
+
+/**
+ * default_cell_size() - 为长度为 size 的文件选择单元大小
+ *
+ * 选择不超过 CELL_MAX 的最大的 2 的幂，使得文件至少能填满 CELL_MIN_CHUNKS 个
+ * chunk，且一个 raw chunk 不超过 CHUNK_MAX 字节。小文件因此仍使用 8 字节的单元，
+ * 大文件则使用以 KB 计的单元，让每次异或和每个 record 都足够长。
+ */
+size_t default_cell_size(size_t size, int p) {
+    size_t cells = (size_t)p * (p - 1);
+    size_t cell = CELL_MIN;
+    while (cell * 2 <= CELL_MAX
+            && cell * 2 * cells <= CHUNK_MAX
+            && size / (cell * 2 * cells) >= CELL_MIN_CHUNKS)
+        cell *= 2;
+    return cell;
+}
+
+/**
+ * metadata_set_size() - 设置原始文件的长度，并据此计算 chunk 的数量
+ *
+ * 调用者应已设置 p 和 cell。
+ */
+void metadata_set_size(Metadata *meta, size_t size) {
+    size_t chunk_data_size = meta->cell * meta->p * (meta->p - 1);
+    meta->size = size;
+    meta->full_chunk_num = size / chunk_data_size;
+    meta->last_chunk_data_size = size - meta->full_chunk_num * chunk_data_size;
+}
+
+static unsigned name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name != '\0'; ++name)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    return h;
+}
+
+/**
+ * metadata_set_rotate() - 为磁盘中名为 name 的文件选择校验列轮转的位数
+ *
+ * 由文件名决定，不需要记录任何状态，文件很多时各个磁盘存放校验列的次数大致
+ * 相同。可以通过环境变量 EVENODD_ROTATE=0 关闭，使各列固定保存在同号的磁盘中。
+ * 调用者应已设置 p。
+ */
+void metadata_set_rotate(Metadata *meta, const char *name) {
+    const char *env = getenv("EVENODD_ROTATE");
+    meta->rotate = 0;
+    if (meta->header_size == METADATA_SIZE && (env == NULL || atoi(env) != 0))
+        meta->rotate = name_hash(name) % (meta->p + 2);
 }
 
 /**
  * get_raw_file_metadata() - 获取原始文件的 Metadata
  *
+ * @cell - 单元大小，为 0 时由 default_cell_size() 决定
+ *
  * 调用者应保证原始文件存在。
  */
-Metadata get_raw_file_metadata(const char *filename, int p) {
-    Metadata result;
+Metadata get_raw_file_metadata(const char *filename, int p, size_t cell) {
     FILE *fp = fopen(filename, "rb");
     assert(fp != NULL);
-    result.p = p;
     fseek(fp, 0, SEEK_END);
-    result.size = ftell(fp);
-    size_t chunk_data_size = sizeof(Packet) * p * (p - 1);
-    result.full_chunk_num = result.size / chunk_data_size;
-    result.last_chunk_data_size = result.size - result.full_chunk_num * chunk_data_size;
+    size_t size = ftell(fp);
+    fclose(fp);
+    return get_raw_metadata(size, p, cell);
+}
+
+/**
+ * get_raw_metadata() - 获取长度为 size 的原始文件的 Metadata
+ *
+ * 与 get_raw_file_metadata() 相同，用于调用者已经知道文件长度的情况，不必再打
+ * 开一次文件。
+ */
+Metadata get_raw_metadata(size_t size, int p, size_t cell) {
+    Metadata result;
+    result.p = p;
+    result.cell = cell != 0 ? cell : default_cell_size(size, p);
+    result.header_size = METADATA_SIZE;
+    result.rotate = 0;
+    metadata_set_size(&result, size);
     return result;
 }
 
 /**
- * get_cooked_file_metadata() - 从 raid 中获取文件的 Metadata
+ * get_stream_metadata() - 为长度未知的输入准备 Metadata
+ *
+ * @cell - 单元大小，为 0 时使用 STREAM_CELL
+ *
+ * 长度暂时记为 0，读完输入后由 metadata_set_size() 更新。
  */
-Metadata get_cooked_file_metadata(const char *filename) {
+Metadata get_stream_metadata(int p, size_t cell) {
     Metadata result;
-    int success = 0;
+    result.p = p;
+    result.cell = cell != 0 ? cell : STREAM_CELL;
+    result.header_size = METADATA_SIZE;
+    result.rotate = 0;
+    metadata_set_size(&result, 0);
+    return result;
+}
 
-    assert(filename != NULL);
-    /* 尝试磁盘 0 1 和 2 ，从第一个成功打开的磁盘中读取文件的 Metadata */
-    for (int i = 0; i < 3; ++i) {
-        char path[PATH_MAX];
-        sprintf(path, "disk_%d/%s", i, filename);
-        FILE *fp = fopen(path, "rb");
-        if (fp != NULL) {
-            fread(&result, sizeof(result), 1, fp);
-            fclose(fp);
-            success = 1;
-            break;
+/**
+ * cooked_name() - 将原始文件名转换为磁盘中使用的文件名
+ *
+ * 原始文件名可以包含目录，磁盘中的文件都直接放在 disk_N 下。'%' 和 '/' 分别转
+ * 义为 "%25" 和 "%2F"，其余字符不变，所以不同的原始文件名总是对应不同的磁盘文
+ * 件名，不含这两个字符的文件名也与 simple_hash() 的结果相同。
+ *
+ * 转换后超过 NAME_MAX 时返回 0。
+ */
+int cooked_name(char name[NAME_MAX + 1], const char *path) {
+    size_t len = 0;
+    for (; *path != '\0'; ++path) {
+        const char *esc = *path == '/' ? "%2F" : *path == '%' ? "%25" : NULL;
+        size_t n = esc != NULL ? 3 : 1;
+        if (len + n > NAME_MAX) {
+            name[len] = '\0';
+            return 0;
+        }
+        memcpy(name + len, esc != NULL ? esc : path, n);
+        len += n;
+    }
+    name[len] = '\0';
+    return 1;
+}
+
+/**
+ * raw_name() - cooked_name() 的逆变换，用于列出文件
+ *
+ * simple_hash() 得到的旧文件名无法还原，原样返回。
+ */
+void raw_name(char path[NAME_MAX + 1], const char *name) {
+    size_t len = 0;
+    for (; *name != '\0'; ++name) {
+        if (strncmp(name, "%2F", 3) == 0 || strncmp(name, "%25", 3) == 0) {
+            path[len++] = name[2] == 'F' ? '/' : '%';
+            name += 2;
+        } else {
+            path[len++] = *name;
         }
     }
-    if (!success) {
+    path[len] = '\0';
+}
+
+/**
+ * simple_hash() - 旧版本使用的磁盘文件名，就地把 '/' 替换为与位置相关的字符
+ *
+ * 不同的原始文件名可能得到相同的结果，例如 "a/b" 和 "aBb"。新写入的文件都使用
+ * cooked_name()，这里只用于读取旧版本写入的文件，见 legacy_name()。
+ */
+static char *simple_hash(char *str) {
+    for (int i = 0; str[i] != '\0'; ++i) {
+        if (str[i] == '/') {
+            str[i] = i + 'A';
+        }
+    }
+    return str;
+}
+
+/**
+ * legacy_name() - 旧版本为原始文件 path 使用的磁盘文件名
+ *
+ * 只有与 cooked_name() 的结果不同时（path 含有 '%' 或 '/'）才得到旧文件名并返回
+ * 1，否则返回 0，不必再查找。
+ */
+static int legacy_name(const char *path, char name[NAME_MAX + 1]) {
+    if (strpbrk(path, "%/") == NULL || strlen(path) > NAME_MAX)
+        return 0;
+    memcpy(name, path, strlen(path) + 1);
+    simple_hash(name);
+    return 1;
+}
+
+/**
+ * lookup_cooked_file() - 为读操作找到原始文件 path 在磁盘中的文件名和 Metadata
+ *
+ * @dirs - 与 get_cooked_file_metadata_at() 相同
+ *
+ * 直接读取 cooked_name() 所得文件的 Metadata，从按文件名选定的磁盘开始，不另外
+ * 检查文件是否存在，找到时只打开了一个磁盘文件。找不到时返回 0，name 仍为
+ * cooked_name() 的结果（文件名过长时为空串），由调用者继续查找。
+ */
+int lookup_cooked_file(const int dirs[METADATA_DISKS], const char *path, char name[NAME_MAX + 1],
+        Metadata *meta) {
+    if (!cooked_name(name, path)) {
+        name[0] = '\0';
+        return 0;
+    }
+    return get_cooked_file_metadata_at(dirs, name, meta);
+}
+
+/**
+ * lookup_legacy_file() - 与 lookup_cooked_file() 相同，但使用旧版本的文件名
+ *
+ * 只用于读取旧版本写入的文件，在 lookup_cooked_file() 和查找打包的文件之后
+ * 调用：同一个文件后来重新写入或打包时，旧版本的磁盘文件仍然存在。
+ */
+int lookup_legacy_file(const int dirs[METADATA_DISKS], const char *path, char name[NAME_MAX + 1],
+        Metadata *meta) {
+    return legacy_name(path, name) && get_cooked_file_metadata_at(dirs, name, meta);
+}
+
+/**
+ * disk_file_size() - 每个磁盘文件的字节数，包括开头的 Metadata
+ */
+size_t disk_file_size(Metadata *x) {
+    assert(x != NULL);
+    size_t size = x->header_size;
+    size += (x->p - 1) * x->cell * x->full_chunk_num;
+    if (x->last_chunk_data_size != 0)
+        size += (x->p - 1) * x->cell;
+    return size;
+}
+
+/**
+ * read_cooked_metadata() - 从目录 dir 中的磁盘文件 name 开头读取 Metadata
+ *
+ * 返回是否成功打开了该文件。
+ */
+static int read_cooked_metadata(int dir, const char *name, Metadata *meta) {
+    int fd = openat(dir, name, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    char buf[sizeof(MetadataV1)] = { 0 };
+    ssize_t ret = pread(fd, buf, sizeof(buf), 0);
+    (void)ret;
+    close(fd);
+    *meta = metadata_from_disk(buf);
+    return 1;
+}
+
+/**
+ * get_cooked_file_metadata() - 从 raid 中获取文件的 Metadata
+ */
+Metadata get_cooked_file_metadata(const char *filename) {
+    Metadata result;
+    if (!get_cooked_file_metadata_at(NULL, filename, &result)) {
         puts("File does not exist！");
         exit(0);
     }
     return result;
 }
 
+/**
+ * get_cooked_file_metadata_at() - 与 get_cooked_file_metadata() 相同，但可以使用
+ *                                 已经打开的磁盘目录
+ *
+ * @dirs - 磁盘 0 到 METADATA_DISKS-1 的目录，打不开的为 -1；为 NULL 时按路径打开
+ *
+ * 文件不存在时不退出，而是返回 0，由调用者决定如何处理。
+ */
+int get_cooked_file_metadata_at(const int dirs[METADATA_DISKS], const char *filename, Metadata *meta) {
+    assert(filename != NULL);
+    /* 从磁盘 0 到 4 中按文件名选定的磁盘开始，依次尝试，至多两个磁盘损坏 */
+    unsigned first = name_hash(filename);
+    for (int k = 0; k < METADATA_DISKS; ++k) {
+        unsigned disk = (first + k) % METADATA_DISKS;
+        char path[PATH_MAX];
+        if (dirs == NULL) {
+            snprintf(path, sizeof(path), "disk_%u/%s", disk, filename);
+            if (read_cooked_metadata(AT_FDCWD, path, meta))
+                return 1;
+        } else if (dirs[disk] != -1 && read_cooked_metadata(dirs[disk], filename, meta)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -2,6 +2,8 @@
 #define METADATA_H_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <linux/limits.h>
 #include "mmio/mmio.h"
 
 /**
@@ -11,23 +13,128 @@
  * @size - 文件长度。文件在 raid 中以 chunk 为单位存储，文件长度不一定能被其大小整除。
  * @full_chunk_num - 为存放文件，需要填满的 chunk 的数量。实际使用的 chunk 数量可能比该值多 1。
  * @last_chunk_data_size - 文件长度不能被 chunk 大小整除时，未满的 chunk 中所填入的数据长度。
+ * @cell - chunk 矩阵中每个单元的字节数，为 sizeof(Packet) 的 2 的幂次倍。
+ * @header_size - Metadata 在每个存储文件开头所占的字节数。
+ * @rotate - 校验列轮转的位数。chunk 中的第 i 列保存在磁盘 (i + rotate) % (p+2)
+ *           中，见 disk_of()。
  *
  * 对每个文件，其 Metadata 是唯一确定的。
  * Metadta 会被存放在 raid 中每个存储文件的开头（也即，保存 p+2 次）。虽然严格
  * 来说，仅需在编号为 0 1 和 2 的三个磁盘中存储 Metadata 即可保证在任何情况下
  * 都能获取到 Metadata，但是为了统一磁盘操作，简化编码，我们选择在每个磁盘都
  * 存储一份。
+ *
+ * 磁盘上的 Metadata 有两种格式：
+ *
+ * - 旧格式：直接写入的 MetadataV0 结构体，单元固定为一个 Packet（8 字节）。
+ * - 新格式：以 METADATA_MAGIC 开头的 MetadataV1 结构体，补零到 METADATA_SIZE
+ *   字节，使其后的各个 record 从页边界开始。
+ *
+ * 旧格式开头是质数 p，不可能等于 METADATA_MAGIC，据此区分两种格式。
+ *
+ * 各列固定保存在同号的磁盘中时，所有文件的两个校验列都落在磁盘 p 和 p+1 上，
+ * 修复时这两个磁盘被读得最多。新格式可以把各列轮转若干位，像 RAID-5/6 那样让
+ * 校验列分散到所有磁盘上。文件仍然只占用磁盘 0 到 p+1，只是各列与磁盘的对应关
+ * 系不同。
  */
 typedef struct {
     int p;
     size_t size;
     size_t full_chunk_num;
     size_t last_chunk_data_size;
+    size_t cell;
+    size_t header_size;
+    int rotate;
 } Metadata;
 
-void skip_metadata(MMIO *file);
+/**
+ * MetadataV0 - 旧格式的磁盘 Metadata
+ */
+typedef struct {
+    int p;
+    size_t size;
+    size_t full_chunk_num;
+    size_t last_chunk_data_size;
+} MetadataV0;
+
+/**
+ * MetadataV1 - 新格式的磁盘 Metadata
+ *
+ * @version - 1 或 2，版本 1 没有 rotate，各列不轮转。不轮转的文件仍然写成版本
+ *            1，不认识 rotate 的旧版本程序也能读取
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t p;
+    uint32_t cell;
+    uint64_t size;
+    uint64_t full_chunk_num;
+    uint64_t last_chunk_data_size;
+    uint32_t rotate;
+    uint32_t reserved;
+} MetadataV1;
+
+#define METADATA_MAGIC (0x4f444e45u) /* "ENDO" */
+#define METADATA_SIZE (4096)
+
+/**
+ * METADATA_DISKS - 每个文件都至少占用磁盘 0 到 METADATA_DISKS-1
+ *
+ * p 至少为 3，每个文件都至少占用 5 个磁盘，每个磁盘文件开头都有 Metadata。读取
+ * Metadata 时在这几个磁盘之间分散，见 get_cooked_file_metadata()。
+ *
+ * 这只分散了读取磁盘文件开头的 Metadata。目录（见 catalog.h）仍然只在磁盘 0 1
+ * 和 2 中：每次写入都在这三个磁盘中各追加一条记录，repair list 和读取打包的文
+ * 件都从中读出目录，只是读取时在三份之间分散。目录有压缩，长度只与现有的文件
+ * 有关，这部分开销不随数据量增长，所以没有把目录也轮转到其他磁盘上。
+ */
+#define METADATA_DISKS (5)
+
+/**
+ * disk_of() - 文件的第 col 列所在的磁盘编号
+ * column_of() - 磁盘 disk 中保存的是文件的哪一列
+ */
+static inline int disk_of(const Metadata *meta, int col) {
+    return (col + meta->rotate) % (meta->p + 2);
+}
+
+static inline int column_of(const Metadata *meta, int disk) {
+    return (disk - meta->rotate + meta->p + 2) % (meta->p + 2);
+}
+
+/**
+ * CELL_MIN CELL_MAX - 单元大小的取值范围
+ */
+#define CELL_MIN (8)
+#define CELL_MAX (1024 * 1024)
+
+/**
+ * STREAM_CELL - 输入长度未知时默认的单元大小
+ *
+ * 不能像 default_cell_size() 那样按长度选择。4KB 的单元使 record 与页对齐，大
+ * 输入的吞吐量接近按长度选择的结果，p 为 101 时一个 raw chunk 也只有约 40MB；
+ * 代价是很小的输入在每个磁盘上也至少占用一个 (p-1) * 4KB 的 record。
+ */
+#define STREAM_CELL (4096)
+
+void skip_metadata(Metadata *meta, MMIO *file);
 void write_metadata(Metadata data, MMIO *file);
-Metadata get_raw_file_metadata(const char *filename, int p);
+void rewrite_metadata(Metadata data, const char *path);
+size_t default_cell_size(size_t size, int p);
+Metadata get_raw_file_metadata(const char *filename, int p, size_t cell);
+Metadata get_raw_metadata(size_t size, int p, size_t cell);
+Metadata get_stream_metadata(int p, size_t cell);
+void metadata_set_size(Metadata *meta, size_t size);
+void metadata_set_rotate(Metadata *meta, const char *name);
 Metadata get_cooked_file_metadata(const char *filename);
+int get_cooked_file_metadata_at(const int dirs[METADATA_DISKS], const char *filename, Metadata *meta);
+int cooked_name(char name[NAME_MAX + 1], const char *path);
+void raw_name(char path[NAME_MAX + 1], const char *name);
+int lookup_cooked_file(const int dirs[METADATA_DISKS], const char *path, char name[NAME_MAX + 1],
+        Metadata *meta);
+int lookup_legacy_file(const int dirs[METADATA_DISKS], const char *path, char name[NAME_MAX + 1],
+        Metadata *meta);
+size_t disk_file_size(Metadata *x);
 
 #endif
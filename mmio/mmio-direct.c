@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "mmio.h"
+#include "../util.h"
+#include <string.h>
+#include <assert.h>
+
+/**
+ * 基于 O_DIRECT 的实现
+ *
+ * 读写都绕过页缓存，处理远大于内存的文件时不会挤掉其他数据，也没有页缓存回写
+ * 带来的不可预测的停顿。
+ *
+ * O_DIRECT 要求文件偏移、长度和内存地址都按块对齐。文件位置、调用者的缓冲区和
+ * 剩余长度都对齐时，直接在调用者的缓冲区与磁盘之间传输；Chunk 的 data 按
+ * CHUNK_ALIGN 对齐，单元不小于 4KB 时 record 也都对齐，所以大文件的读写基本都
+ * 走这条路。其余情况（Metadata、小单元的 record、文件末尾）经过一个对齐的缓冲
+ * 区，按整块读写。
+ *
+ * 文件系统不支持 O_DIRECT 时（例如较旧内核上的 tmpfs）退回普通的读写，行为不变。
+ *
+ * 读时 buf 中缓存了文件中从 buf_off 开始的 buf_len 个字节。写时 buf 中有 buf_len
+ * 个字节尚未写入，它们属于文件中紧挨着 pos 之前的位置，起点总是对齐的。
+ */
+
+/**
+ * DIRECT_ALIGN - 对齐要求，覆盖 512 字节和 4KB 扇区的设备
+ * DIRECT_BLOCK - 缓冲区大小，也是不对齐时每次读写的字节数
+ */
+#define DIRECT_ALIGN (4096)
+#define DIRECT_BLOCK (1024 * 1024)
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+#define ALIGNED(x) (((size_t)(x) & (DIRECT_ALIGN - 1)) == 0)
+
+/**
+ * open_direct() - 尽量以 O_DIRECT 打开文件
+ */
+static int open_direct(int dir, const char *fname, int flags) {
+    int fd = openat(dir, fname, flags | O_DIRECT, 0644);
+    if (fd == -1 && errno == EINVAL)
+        fd = openat(dir, fname, flags, 0644);
+    return fd;
+}
+
+void mmrd_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    x->fd = open_direct(dir, fname, O_RDONLY);
+    if (x->fd == -1)
+        return;
+    x->size = size;
+    x->pos = 0;
+    x->buf = aligned_alloc(DIRECT_ALIGN, DIRECT_BLOCK);
+    assert(x->buf != NULL);
+    x->buf_off = 0;
+    x->buf_len = 0;
+}
+
+void mmrd_close(MMIO *x) {
+    assert(x->fd != -1);
+    free(x->buf);
+    close(x->fd);
+    x->fd = -1;
+}
+
+size_t mmread(void *buf, size_t size, MMIO *x) {
+    size_t total = 0;
+    size = min(size, x->size - x->pos);
+    while (total < size) {
+        char *dst = (char *)buf + total;
+        size_t left = size - total;
+        size_t off = x->buf_off;
+        if (x->pos >= off && x->pos < off + x->buf_len) {
+            size_t len = min(left, off + x->buf_len - x->pos);
+            memcpy(dst, (char *)x->buf + (x->pos - off), len);
+            total += len;
+            x->pos += len;
+            continue;
+        }
+
+        ssize_t ret;
+        if (ALIGNED(x->pos) && ALIGNED(dst) && left >= DIRECT_ALIGN) {
+            ret = pread(x->fd, dst, left / DIRECT_ALIGN * DIRECT_ALIGN, x->pos);
+            if (ret <= 0)
+                break;
+            total += ret;
+            x->pos += ret;
+        } else {
+            x->buf_off = x->pos / DIRECT_ALIGN * DIRECT_ALIGN;
+            ret = pread(x->fd, x->buf, DIRECT_BLOCK, x->buf_off);
+            x->buf_len = ret < 0 ? 0 : (size_t)ret;
+            if (x->buf_len <= x->pos - x->buf_off)
+                break;
+        }
+    }
+    return total;
+}
+
+/**
+ * mmview() - 本实现没有映射文件，总是返回 NULL，调用者应改用 mmread()
+ *
+ * 不会推进文件位置。
+ */
+const void *mmview(UNUSED_PARAM size_t size, UNUSED_PARAM MMIO *x, size_t *len) {
+    *len = 0;
+    return NULL;
+}
+
+/**
+ * mmrd_seek() - 将读位置移动到文件中的 pos 处
+ *
+ * 只能向前移动。缓冲区仍然按文件偏移使用，其中的数据若覆盖 pos 则继续有效。
+ */
+void mmrd_seek(MMIO *x, size_t pos) {
+    x->pos = min(pos, x->size);
+}
+
+/**
+ * mmrd_prefetch() - 什么也不做
+ *
+ * 读取绕过页缓存，提前读入页缓存的数据用不上。
+ */
+void mmrd_prefetch(UNUSED_PARAM MMIO *x, UNUSED_PARAM size_t pos, UNUSED_PARAM size_t len) {
+}
+
+void mmwr_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    x->fd = open_direct(dir, fname, O_WRONLY | O_CREAT | O_TRUNC);
+    if (x->fd == -1)
+        return;
+    x->size = size;
+    x->pos = 0;
+    if (size != MMIO_SIZE_UNKNOWN)
+        fallocate(x->fd, 0, 0, x->size);
+    x->buf = aligned_alloc(DIRECT_ALIGN, DIRECT_BLOCK);
+    assert(x->buf != NULL);
+    x->buf_len = 0;
+}
+
+/**
+ * mmwr_open_at() - pos 不对齐时（例如旧格式的 Metadata 之后），先读入所在块中
+ *                  pos 之前的部分，使缓冲区的起点仍然是对齐的
+ *
+ * 这一块会被整块写回，所以 pos 不对齐时，不能有其他线程同时写入这一块。
+ */
+void mmwr_open_at(MMIO *x, const char *fname, size_t size, size_t pos) {
+    x->fd = open_direct(AT_FDCWD, fname, O_RDWR);
+    if (x->fd == -1)
+        return;
+    x->size = size;
+    x->pos = pos;
+    x->buf = aligned_alloc(DIRECT_ALIGN, DIRECT_BLOCK);
+    assert(x->buf != NULL);
+    x->buf_len = pos & (DIRECT_ALIGN - 1);
+    if (x->buf_len != 0) {
+        ssize_t ret = pread(x->fd, x->buf, DIRECT_ALIGN, pos - x->buf_len);
+        ret = ret < 0 ? 0 : ret;
+        if ((size_t)ret < x->buf_len)
+            memset((char *)x->buf + ret, 0, x->buf_len - ret);
+    }
+}
+
+/**
+ * flush_buf() - 写出缓冲区中的数据，不足一块的部分补零到对齐
+ *
+ * 补上的零可能超出写入的数据，由 mmwr_close() 截掉。
+ */
+static void flush_buf(MMIO *x) {
+    size_t len = x->buf_len;
+    size_t padded = ROUNDUP(len, DIRECT_ALIGN);
+    memset((char *)x->buf + len, 0, padded - len);
+    ssize_t ret = pwrite(x->fd, x->buf, padded, x->pos - len);
+    assert(ret == (ssize_t)padded);
+    (void)ret;
+    x->buf_len = 0;
+}
+
+void mmwr_close(MMIO *x) {
+    assert(x->fd != -1);
+    if (x->buf_len != 0) {
+        int padded = !ALIGNED(x->pos);
+        flush_buf(x);
+        /* 只有补过零时才截断，否则可能截掉其他线程写在后面的数据 */
+        int ret = padded ? ftruncate(x->fd, x->pos) : 0;
+        assert(ret == 0);
+        (void)ret;
+    }
+    free(x->buf);
+    close(x->fd);
+    x->fd = -1;
+}
+
+size_t mmwrite(void *buf, size_t size, MMIO *x) {
+    size_t total = 0;
+    size = min(size, x->size - x->pos);
+    while (total < size) {
+        char *src = (char *)buf + total;
+        size_t left = size - total;
+        if (x->buf_len == 0 && ALIGNED(x->pos) && ALIGNED(src) && left >= DIRECT_ALIGN) {
+            ssize_t ret = pwrite(x->fd, src, left / DIRECT_ALIGN * DIRECT_ALIGN, x->pos);
+            if (ret <= 0)
+                break;
+            total += ret;
+            x->pos += ret;
+            continue;
+        }
+        size_t len = min(left, DIRECT_BLOCK - x->buf_len);
+        memcpy((char *)x->buf + x->buf_len, src, len);
+        x->buf_len += len;
+        total += len;
+        x->pos += len;
+        if (x->buf_len == DIRECT_BLOCK)
+            flush_buf(x);
+    }
+    return total;
+}
@@ -4,11 +4,11 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include "mmio.h"
+#include "mmio-window.h"
 #include <string.h>
 #include <assert.h>
 
 #define MMIO_RDMAP_OPTION (MAP_NORESERVE | MAP_SHARED)
-#define MMIO_RDMAP_MADVICE (MADV_SEQUENTIAL | MADV_WILLNEED)
 #define MMIO_RDMAP_FADVICE (POSIX_FADV_SEQUENTIAL | POSIX_FADV_WILLNEED)
 #define MMIO_WRMAP_OPTION (MAP_NORESERVE | MAP_SHARED)
 #define MMIO_WRMAP_MADVICE (0)
@@ -17,15 +17,14 @@
 
 #define min(x, y) ((x) < (y) ? (x) : (y))
 
-void mmrd_open(MMIO *x, const char *fname, size_t size) {
-    x->fd = open(fname, O_RDONLY);
+void mmrd_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    x->fd = openat(dir, fname, O_RDONLY);
     if (x->fd == -1)
         return;
     x->size = size;
     x->pos = 0;
     posix_fadvise64(x->fd, 0, x->size, MMIO_RDMAP_FADVICE);
-    x->buf = mmap(NULL, x->size, PROT_READ, MMIO_RDMAP_OPTION, x->fd, 0);
-    madvise(x->buf, x->size, MMIO_RDMAP_MADVICE);
+    window_read_open(x, MMIO_RDMAP_OPTION);
 }
 
 void mmrd_close(MMIO *x) {
@@ -36,14 +35,44 @@ void mmrd_close(MMIO *x) {
 }
 
 size_t mmread(void *buf, size_t size, MMIO *x) {
+    window_read_advance(x);
     size_t len = min(size, x->size - x->pos);
     memcpy(buf, x->buf + x->pos, len);
     x->pos += len;
     return len;
 }
 
-void mmwr_open(MMIO *x, const char *fname, size_t size) {
-    x->fp = fopen(fname, "wb");
+/**
+ * mmview() - 不复制数据，直接返回文件当前位置在映射中的地址
+ *
+ * @len - 实际可读的字节数，文件剩余数据不足 size 时小于 size
+ *
+ * 与 mmread() 一样会推进文件位置。返回的指针在 mmrd_close() 之前有效，且只读。
+ */
+const void *mmview(size_t size, MMIO *x, size_t *len) {
+    window_read_advance(x);
+    const char *result = (const char *)x->buf + x->pos;
+    *len = min(size, x->size - x->pos);
+    x->pos += *len;
+    return result;
+}
+
+/**
+ * mmrd_seek() - 将读位置移动到文件中的 pos 处
+ *
+ * 只能向前移动。
+ */
+void mmrd_seek(MMIO *x, size_t pos) {
+    window_read_seek(x, pos);
+}
+
+void mmrd_prefetch(MMIO *x, size_t pos, size_t len) {
+    window_prefetch(x, pos, len);
+}
+
+void mmwr_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    int fd = openat(dir, fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    x->fp = fd != -1 ? fdopen(fd, "wb") : NULL;
     if (x->fp == NULL) {
         x->fd = -1;
         return;
@@ -51,11 +80,25 @@ void mmwr_open(MMIO *x, const char *fname, size_t size) {
     x->fd = fileno(x->fp);
     x->size = size;
     x->pos = 0;
-    fallocate(x->fd, 0, 0, x->size);
+    if (size != MMIO_SIZE_UNKNOWN)
+        fallocate(x->fd, 0, 0, x->size);
     posix_fadvise64(x->fd, 0, x->size, MMIO_WRMAP_FADVICE);
     setvbuf(x->fp, NULL, _IOFBF, MYBUFSIZE);
 }
 
+void mmwr_open_at(MMIO *x, const char *fname, size_t size, size_t pos) {
+    x->fp = fopen(fname, "r+b");
+    if (x->fp == NULL) {
+        x->fd = -1;
+        return;
+    }
+    x->fd = fileno(x->fp);
+    x->size = size;
+    x->pos = pos;
+    fseeko(x->fp, (off_t)pos, SEEK_SET);
+    setvbuf(x->fp, NULL, _IOFBF, MYBUFSIZE);
+}
+
 void mmwr_close(MMIO *x) {
     assert(x->fp != NULL);
     fclose(x->fp);
@@ -5,9 +5,11 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include "mmio.h"
+#include "../util.h"
 #include <string.h>
 #include <sys/sendfile.h>
 #include <limits.h>
+#include <signal.h>
 
 #define MMIO_RDMAP_FADVICE (POSIX_FADV_SEQUENTIAL | POSIX_FADV_WILLNEED)
 #define MMIO_WRMAP_FADVICE (0)
@@ -21,14 +23,24 @@ typedef struct {
     size_t size;
 } Context;
 
+/**
+ * copy_file_to_pipe() - 读文件时在后台把文件内容送入管道
+ *
+ * 读者可能不读到文件末尾就调用 mmrd_close()，此时管道的读端已经关闭，这里屏
+ * 蔽 SIGPIPE，写入失败时结束即可。
+ */
 static void *copy_file_to_pipe(void *data) {
     Context *ctx = (Context *)data;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
     while (ctx->size > 0) {
-        size_t bytes = sendfile(ctx->out_fd, ctx->in_fd, NULL, ctx->size);
-        ctx->size -= bytes;
-        if (bytes == 0) {
+        ssize_t bytes = sendfile(ctx->out_fd, ctx->in_fd, NULL, ctx->size);
+        if (bytes <= 0) {
             break;
         }
+        ctx->size -= bytes;
     }
     close(ctx->in_fd);
     close(ctx->out_fd);
@@ -51,8 +63,8 @@ static void *copy_pipe_to_file(void *data) {
     return NULL;
 }
 
-void mmrd_open(MMIO *x, const char *fname, size_t size) {
-    int fd = open(fname, O_RDONLY);
+void mmrd_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    int fd = openat(dir, fname, O_RDONLY);
     if (fd == -1) {
         x->fd = -1;
         return;
@@ -78,18 +90,48 @@ void mmrd_open(MMIO *x, const char *fname, size_t size) {
 }
 
 void mmrd_close(MMIO *x) {
-    pthread_join(x->tid, NULL);
     fclose(x->fp);
+    pthread_join(x->tid, NULL);
     x->fd = -1;
 }
 
 size_t mmread(void *buf, size_t size, MMIO *x) {
     size_t result = fread(buf, 1, size, x->fp);
+    x->pos += result;
     return result;
 }
 
-void mmwr_open(MMIO *x, const char *fname, size_t size) {
-    int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+/**
+ * mmrd_seek() - 将读位置移动到文件中的 pos 处
+ *
+ * 只能向前移动。管道不能定位，只能读出中间的数据并丢弃。
+ */
+void mmrd_seek(MMIO *x, size_t pos) {
+    char buf[BUF_SIZE];
+    while (x->pos < pos) {
+        if (mmread(buf, min(pos - x->pos, sizeof(buf)), x) == 0)
+            break;
+    }
+}
+
+/**
+ * mmview() - 本实现没有映射文件，总是返回 NULL，调用者应改用 mmread()
+ *
+ * 不会推进文件位置。
+ */
+const void *mmview(UNUSED_PARAM size_t size, UNUSED_PARAM MMIO *x, size_t *len) {
+    *len = 0;
+    return NULL;
+}
+
+/**
+ * mmrd_prefetch() - 什么也不做，后台线程本来就在提前把文件送入管道
+ */
+void mmrd_prefetch(UNUSED_PARAM MMIO *x, UNUSED_PARAM size_t pos, UNUSED_PARAM size_t len) {
+}
+
+void mmwr_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    int fd = openat(dir, fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (fd == -1) {
         x->fd = -1;
         return;
@@ -97,7 +139,8 @@ void mmwr_open(MMIO *x, const char *fname, size_t size) {
 
     x->size = size;
     x->pos = 0;
-    fallocate(fd, 0, 0, x->size);
+    if (size != MMIO_SIZE_UNKNOWN)
+        fallocate(fd, 0, 0, x->size);
     posix_fadvise64(fd, 0, x->size, MMIO_WRMAP_FADVICE);
 
     Context *ctx = (Context *)malloc(sizeof(Context));
@@ -114,6 +157,34 @@ void mmwr_open(MMIO *x, const char *fname, size_t size) {
     setvbuf(x->fp, NULL, _IOFBF, BUF_SIZE);
 }
 
+/**
+ * mmwr_open_at() - 后台线程从文件的当前位置开始写，所以先定位到 pos
+ */
+void mmwr_open_at(MMIO *x, const char *fname, size_t size, size_t pos) {
+    int fd = open(fname, O_WRONLY);
+    if (fd == -1) {
+        x->fd = -1;
+        return;
+    }
+    lseek(fd, (off_t)pos, SEEK_SET);
+
+    x->size = size;
+    x->pos = pos;
+
+    Context *ctx = (Context *)malloc(sizeof(Context));
+    pipe(x->pipefd);
+    fcntl(x->pipefd[1], F_SETPIPE_SZ, PIPE_SIZE);
+    ctx->in_fd = x->pipefd[0];
+    ctx->out_fd = fd;
+    ctx->size = size - pos;
+
+    pthread_create(&x->tid, NULL, copy_pipe_to_file, ctx);
+
+    x->fd = x->pipefd[1];
+    x->fp = fdopen(x->fd, "wb");
+    setvbuf(x->fp, NULL, _IOFBF, BUF_SIZE);
+}
+
 void mmwr_close(MMIO *x) {
     fclose(x->fp);
     pthread_join(x->tid, NULL);
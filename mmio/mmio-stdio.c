@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include "mmio.h"
+#include "../util.h"
 #include <string.h>
 
 #define MMIO_RDMAP_FADVICE (POSIX_FADV_SEQUENTIAL | POSIX_FADV_WILLNEED | POSIX_FADV_NOREUSE)
@@ -12,8 +13,9 @@
 
 #define min(x, y) ((x) < (y) ? (x) : (y))
 
-void mmrd_open(MMIO *x, const char *fname, size_t size) {
-    x->fp = fopen(fname, "rb");
+void mmrd_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    int fd = openat(dir, fname, O_RDONLY);
+    x->fp = fd != -1 ? fdopen(fd, "rb") : NULL;
     if (x->fp == NULL) {
         x->fd = -1;
         return;
@@ -31,11 +33,41 @@ void mmrd_close(MMIO *x) {
 }
 
 size_t mmread(void *buf, size_t size, MMIO *x) {
-    return fread(buf, 1, size, x->fp);
+    size_t result = fread(buf, 1, size, x->fp);
+    x->pos += result;
+    return result;
 }
 
-void mmwr_open(MMIO *x, const char *fname, size_t size) {
-    x->fp = fopen(fname, "wb");
+/**
+ * mmview() - 本实现没有映射文件，总是返回 NULL，调用者应改用 mmread()
+ *
+ * 不会推进文件位置。
+ */
+const void *mmview(UNUSED_PARAM size_t size, UNUSED_PARAM MMIO *x, size_t *len) {
+    *len = 0;
+    return NULL;
+}
+
+/**
+ * mmrd_seek() - 将读位置移动到文件中的 pos 处
+ *
+ * 只能向前移动。
+ */
+void mmrd_seek(MMIO *x, size_t pos) {
+    fseek(x->fp, (long)pos, SEEK_SET);
+    x->pos = pos;
+}
+
+/**
+ * mmrd_prefetch() - 让内核把这一段读入页缓存，fread() 时只需复制
+ */
+void mmrd_prefetch(MMIO *x, size_t pos, size_t len) {
+    readahead(x->fd, (off64_t)pos, len);
+}
+
+void mmwr_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    int fd = openat(dir, fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    x->fp = fd != -1 ? fdopen(fd, "wb") : NULL;
     if (x->fp == NULL) {
         x->fd = -1;
         return;
@@ -43,11 +75,25 @@ void mmwr_open(MMIO *x, const char *fname, size_t size) {
     x->fd = fileno(x->fp);
     x->size = size;
     x->pos = 0;
-    fallocate(x->fd, 0, 0, x->size);
+    if (size != MMIO_SIZE_UNKNOWN)
+        fallocate(x->fd, 0, 0, x->size);
     posix_fadvise64(x->fd, 0, x->size, MMIO_WRMAP_FADVICE);
     setvbuf(x->fp, NULL, _IOFBF, MYBUFSIZE);
 }
 
+void mmwr_open_at(MMIO *x, const char *fname, size_t size, size_t pos) {
+    x->fp = fopen(fname, "r+b");
+    if (x->fp == NULL) {
+        x->fd = -1;
+        return;
+    }
+    x->fd = fileno(x->fp);
+    x->size = size;
+    x->pos = pos;
+    fseeko(x->fp, (off_t)pos, SEEK_SET);
+    setvbuf(x->fp, NULL, _IOFBF, MYBUFSIZE);
+}
+
 void mmwr_close(MMIO *x) {
     fclose(x->fp);
     x->fd = -1;
@@ -0,0 +1,117 @@
+#ifndef MMIO_STREAM_H_
+#define MMIO_STREAM_H_
+
+/**
+ * 直接读写标准输入、标准输出等文件描述符，不经过 MMIO 的各种实现
+ *
+ * 管道既不能映射，也不能定位，长度事先未知，MMIO 的各种实现都不适用。这里的
+ * MMIO 只用到 fd、pos 和 size 三个字段，由调用者直接初始化，不需要打开和关闭：
+ *
+ *   MMIO in = { .fd = STDIN_FILENO, .pos = 0 };
+ *
+ * 出错时打印原因并退出。
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "mmio.h"
+
+/**
+ * STREAM_PIPE_SIZE - 输出到管道时尝试设置的管道容量
+ */
+#define STREAM_PIPE_SIZE (1024 * 1024)
+
+/**
+ * stream_read() - 读取 size 个字节，直到读满或遇到文件末尾，返回读到的字节数
+ */
+static inline size_t stream_read(void *buf, size_t size, MMIO *x) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t ret = read(x->fd, (char *)buf + total, size - total);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            perror("read");
+            exit(1);
+        }
+        if (ret == 0)
+            break;
+        total += ret;
+    }
+    x->pos += total;
+    return total;
+}
+
+/**
+ * stream_write() - 写出 size 个字节，超出 x->size 的部分被丢弃
+ */
+static inline size_t stream_write(const void *buf, size_t size, MMIO *x) {
+    size_t total = 0;
+    size = size < x->size - x->pos ? size : x->size - x->pos;
+    while (total < size) {
+        ssize_t ret = write(x->fd, (const char *)buf + total, size - total);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            perror("write");
+            exit(1);
+        }
+        total += ret;
+    }
+    x->pos += total;
+    return total;
+}
+
+/**
+ * stream_pipe() - x 是否为管道。是管道时顺便扩大其容量，失败时忽略
+ */
+static inline int stream_pipe(MMIO *x) {
+    struct stat st;
+    if (fstat(x->fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+        return 0;
+    fcntl(x->fd, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+    return 1;
+}
+
+/**
+ * stream_splice() - 用 vmsplice() 将 iov 所描述的 num 段内存送入管道 x
+ *
+ * 管道只引用这些内存所在的页，不复制数据，所以在读者取走之前，这些内存都不能
+ * 被修改。只应用于只读映射的文件，不能用于之后会重复使用的缓冲区。x->size 之
+ * 后的部分被丢弃。
+ */
+static inline void stream_splice(struct iovec *iov, int num, MMIO *x) {
+    int k = 0;
+    while (k < num && x->pos < x->size) {
+        size_t left = x->size - x->pos;
+        int n;
+        size_t len = 0;
+        for (n = k; n < num && len < left; ++n)
+            len += iov[n].iov_len;
+        if (len > left)
+            iov[n - 1].iov_len -= len - left;
+
+        ssize_t ret = vmsplice(x->fd, iov + k, n - k, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            perror("vmsplice");
+            exit(1);
+        }
+        x->pos += ret;
+        /* 跳过已经送入管道的部分 */
+        while (k < num && (size_t)ret >= iov[k].iov_len)
+            ret -= iov[k++].iov_len;
+        if (k < num) {
+            iov[k].iov_base = (char *)iov[k].iov_base + ret;
+            iov[k].iov_len -= ret;
+        }
+    }
+}
+
+#endif
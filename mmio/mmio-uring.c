@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "mmio.h"
+#include "../util.h"
+#include <string.h>
+#include <assert.h>
+
+/**
+ * 基于 io_uring 的实现
+ *
+ * 对外仍是同步的接口，但每个文件都有自己的 io_uring 和 URING_DEPTH 个块大小为
+ * URING_BLOCK 的缓冲区：读时提前提交后面的块（预读），写时把数据复制到缓冲区后
+ * 立即返回，由内核在后台写入（回写）。这样即使只有一个线程依次读写 p+2 个文件，
+ * 每个文件也都有 URING_DEPTH 个请求同时在处理中，p 较大时不需要为每个文件开一个
+ * 线程。
+ *
+ * 缓冲区通过 IORING_REGISTER_BUFFERS 注册，使用 READ_FIXED/WRITE_FIXED，内核
+ * 不必为每个请求重新映射用户页。注册受 RLIMIT_MEMLOCK 限制，失败时退回普通的
+ * READ/WRITE。创建 io_uring 失败时（内核太旧或被禁用）退回同步的 pread/pwrite。
+ *
+ * 不使用 liburing，直接通过系统调用操作 io_uring。
+ */
+
+#define MMIO_RDMAP_FADVICE (POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE)
+
+/**
+ * URING_DEPTH - 每个文件同时在处理中的请求数量
+ * URING_BLOCK - 每个请求的字节数
+ */
+#define URING_DEPTH (8)
+#define URING_BLOCK (64 * 1024)
+
+#define min(x, y) ((x) < (y) ? (x) : (y))
+
+/**
+ * UringSlot - 一个缓冲块
+ *
+ * @off - 块在文件中的偏移
+ * @len - 提交的字节数
+ * @busy - 是否已经提交且尚未完成
+ * @res - 完成时内核返回的结果，即实际读写的字节数或负的错误码
+ */
+typedef struct {
+    size_t off;
+    size_t len;
+    int busy;
+    int res;
+} UringSlot;
+
+/**
+ * MMRing - 一个文件的 io_uring 及其缓冲区
+ *
+ * @head - 当前正在读出或填充的块
+ * @used - 当前块中已经读出或填充的字节数
+ * @next - 读时下一个要提交的块在文件中的偏移
+ *
+ * 块按 head, head+1, ... 的顺序循环使用，与文件中的顺序一致。
+ */
+typedef struct MMRing {
+    int fd;
+    int fixed;
+    unsigned int *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+
+    char *slab;
+    UringSlot slot[URING_DEPTH];
+    unsigned int head;
+    size_t used;
+    size_t next;
+} MMRing;
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait,
+            wait != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/**
+ * ring_new() - 创建 io_uring 并注册缓冲区，失败时返回 NULL
+ */
+static MMRing *ring_new(void) {
+    struct io_uring_params p;
+    MMRing *r = calloc(1, sizeof(MMRing));
+    assert(r != NULL);
+    memset(&p, 0, sizeof(p));
+    r->fd = uring_setup(URING_DEPTH, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_SQ_RING);
+    assert(r->sq_ptr != MAP_FAILED);
+    r->cq_ptr = r->sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                r->fd, IORING_OFF_CQ_RING);
+        assert(r->cq_ptr != MAP_FAILED);
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_SQES);
+    assert(r->sqes != MAP_FAILED);
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    r->slab = aligned_alloc(4096, URING_DEPTH * URING_BLOCK);
+    assert(r->slab != NULL);
+    struct iovec iov = { .iov_base = r->slab, .iov_len = URING_DEPTH * URING_BLOCK };
+    r->fixed = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    return r;
+}
+
+static void ring_drop(MMRing *r) {
+    for (int k = 0; k < URING_DEPTH; ++k)
+        assert(!r->slot[k].busy);
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+    free(r->slab);
+    free(r);
+}
+
+/**
+ * ring_submit() - 提交第 k 块的读或写请求
+ */
+static void ring_submit(MMRing *r, int file, int k, int write) {
+    unsigned int tail = *r->sq_tail;
+    unsigned int idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    UringSlot *slot = &r->slot[k];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (r->fixed)
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    else
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = file;
+    sqe->addr = (unsigned long)(r->slab + (size_t)k * URING_BLOCK);
+    sqe->len = slot->len;
+    sqe->off = slot->off;
+    sqe->buf_index = 0;
+    sqe->user_data = k;
+    r->sq_array[idx] = idx;
+    slot->busy = 1;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    int ret = uring_enter(r->fd, 1, 0);
+    assert(ret == 1);
+    (void)ret;
+}
+
+/**
+ * ring_wait() - 等待第 k 块的请求完成
+ *
+ * 顺带收取其他已经完成的请求。读写不完整时（文件末尾以外很少发生）用 pread 或
+ * pwrite 补齐剩余部分，返回后 res 即该块实际读写的字节数。
+ */
+static void ring_wait(MMRing *r, int file, int k, int write) {
+    UringSlot *slot = &r->slot[k];
+    while (slot->busy) {
+        unsigned int head = *r->cq_head;
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            uring_enter(r->fd, 0, 1);
+            continue;
+        }
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        r->slot[cqe->user_data].res = cqe->res;
+        r->slot[cqe->user_data].busy = 0;
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    char *buf = r->slab + (size_t)k * URING_BLOCK;
+    ssize_t done = slot->res < 0 ? 0 : slot->res;
+    while ((size_t)done < slot->len) {
+        ssize_t ret = write
+            ? pwrite(file, buf + done, slot->len - done, slot->off + done)
+            : pread(file, buf + done, slot->len - done, slot->off + done);
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+    slot->res = (int)done;
+}
+
+/**
+ * ring_prefetch() - 用第 k 块预读文件中下一个尚未提交的块
+ */
+static void ring_prefetch(MMIO *x, int k) {
+    MMRing *r = x->ring;
+    if (r->next >= x->size)
+        return;
+    r->slot[k].off = r->next;
+    r->slot[k].len = min(URING_BLOCK, x->size - r->next);
+    r->next += r->slot[k].len;
+    ring_submit(r, x->fd, k, 0);
+}
+
+void mmrd_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    x->fd = openat(dir, fname, O_RDONLY);
+    if (x->fd == -1)
+        return;
+    x->size = size;
+    x->pos = 0;
+    posix_fadvise64(x->fd, 0, x->size, MMIO_RDMAP_FADVICE);
+    x->ring = ring_new();
+    if (x->ring == NULL)
+        return;
+    for (int k = 0; k < URING_DEPTH; ++k)
+        ring_prefetch(x, k);
+}
+
+void mmrd_close(MMIO *x) {
+    assert(x->fd != -1);
+    MMRing *r = x->ring;
+    if (r != NULL) {
+        for (int k = 0; k < URING_DEPTH; ++k)
+            ring_wait(r, x->fd, k, 0);
+        ring_drop(r);
+        x->ring = NULL;
+    }
+    close(x->fd);
+    x->fd = -1;
+}
+
+size_t mmread(void *buf, size_t size, MMIO *x) {
+    MMRing *r = x->ring;
+    size_t total = 0;
+    size = min(size, x->size - x->pos);
+    if (r == NULL) {
+        ssize_t ret = pread(x->fd, buf, size, x->pos);
+        total = ret < 0 ? 0 : (size_t)ret;
+        x->pos += total;
+        return total;
+    }
+
+    while (total < size) {
+        int k = r->head;
+        UringSlot *slot = &r->slot[k];
+        if (r->used == 0)
+            ring_wait(r, x->fd, k, 0);
+        if (r->used >= (size_t)slot->res) {
+            /* 文件实际比 size 短 */
+            if (slot->res < (int)slot->len)
+                break;
+            r->used = 0;
+            r->head = (k + 1) % URING_DEPTH;
+            ring_prefetch(x, k);
+            continue;
+        }
+        size_t len = min(size - total, (size_t)slot->res - r->used);
+        memcpy((char *)buf + total, r->slab + (size_t)k * URING_BLOCK + r->used, len);
+        total += len;
+        r->used += len;
+        x->pos += len;
+    }
+    return total;
+}
+
+/**
+ * mmview() - 本实现没有映射文件，总是返回 NULL，调用者应改用 mmread()
+ *
+ * 不会推进文件位置。
+ */
+const void *mmview(UNUSED_PARAM size_t size, UNUSED_PARAM MMIO *x, size_t *len) {
+    *len = 0;
+    return NULL;
+}
+
+/**
+ * mmrd_seek() - 将读位置移动到文件中的 pos 处
+ *
+ * 只能向前移动。等待已经提交的预读完成后丢弃，从 pos 处重新预读。
+ */
+void mmrd_seek(MMIO *x, size_t pos) {
+    MMRing *r = x->ring;
+    x->pos = min(pos, x->size);
+    if (r == NULL)
+        return;
+    for (int k = 0; k < URING_DEPTH; ++k)
+        ring_wait(r, x->fd, k, 0);
+    r->head = 0;
+    r->used = 0;
+    r->next = x->pos;
+    for (int k = 0; k < URING_DEPTH; ++k)
+        ring_prefetch(x, k);
+}
+
+/**
+ * mmrd_prefetch() - 让内核把这一段读入页缓存
+ *
+ * 环中的预读只覆盖 URING_DEPTH 块，更远的部分由内核提前读入，提交读请求时数
+ * 据已经在页缓存中。
+ */
+void mmrd_prefetch(MMIO *x, size_t pos, size_t len) {
+    readahead(x->fd, (off64_t)pos, len);
+}
+
+void mmwr_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    x->fd = openat(dir, fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (x->fd == -1)
+        return;
+    x->size = size;
+    x->pos = 0;
+    if (size != MMIO_SIZE_UNKNOWN)
+        fallocate(x->fd, 0, 0, x->size);
+    x->ring = ring_new();
+}
+
+void mmwr_open_at(MMIO *x, const char *fname, size_t size, size_t pos) {
+    x->fd = open(fname, O_WRONLY);
+    if (x->fd == -1)
+        return;
+    x->size = size;
+    x->pos = pos;
+    x->ring = ring_new();
+}
+
+/**
+ * flush_slot() - 提交当前块中已经填充的数据，换到下一块
+ */
+static void flush_slot(MMIO *x) {
+    MMRing *r = x->ring;
+    int k = r->head;
+    if (r->used == 0)
+        return;
+    r->slot[k].off = x->pos - r->used;
+    r->slot[k].len = r->used;
+    ring_submit(r, x->fd, k, 1);
+    r->used = 0;
+    r->head = (k + 1) % URING_DEPTH;
+}
+
+void mmwr_close(MMIO *x) {
+    assert(x->fd != -1);
+    MMRing *r = x->ring;
+    if (r != NULL) {
+        flush_slot(x);
+        for (int k = 0; k < URING_DEPTH; ++k)
+            ring_wait(r, x->fd, k, 1);
+        ring_drop(r);
+        x->ring = NULL;
+    }
+    close(x->fd);
+    x->fd = -1;
+}
+
+size_t mmwrite(void *buf, size_t size, MMIO *x) {
+    MMRing *r = x->ring;
+    size_t total = 0;
+    size = min(size, x->size - x->pos);
+    if (r == NULL) {
+        ssize_t ret = pwrite(x->fd, buf, size, x->pos);
+        total = ret < 0 ? 0 : (size_t)ret;
+        x->pos += total;
+        return total;
+    }
+
+    while (total < size) {
+        int k = r->head;
+        if (r->used == 0)
+            ring_wait(r, x->fd, k, 1);
+        size_t len = min(size - total, URING_BLOCK - r->used);
+        memcpy(r->slab + (size_t)k * URING_BLOCK + r->used, (const char *)buf + total, len);
+        total += len;
+        r->used += len;
+        x->pos += len;
+        if (r->used == URING_BLOCK)
+            flush_slot(x);
+    }
+    return total;
+}
@@ -0,0 +1,155 @@
+#ifndef MMIO_WINDOW_H_
+#define MMIO_WINDOW_H_
+
+/**
+ * 映射文件时的滑动窗口，供 mmio.c 和 mmio-mixed.c 使用
+ *
+ * 整个文件映射到内存中时，读过的页一直留在进程的页表里，文件有数 GB、磁盘有上
+ * 百个时，占用的内存随文件大小增长。这里只让 pos 附近的一段保持映射：
+ *
+ *   - 读：前方 MMIO_WINDOW 字节预先填好页表（MADV_POPULATE_READ），再往前一个
+ *     窗口提示内核预读（MADV_WILLNEED）；落后 pos 超过 MMIO_KEEP 的部分用
+ *     MADV_DONTNEED 丢弃。映射本身保持不变，mmview() 返回的指针仍然一直有效：
+ *     丢弃的只是页表项，再次访问时会从页缓存中重新建立，内容不变。
+ *
+ *   - 写：每次只映射 MMIO_WINDOW 字节，写满后解除映射，通过 sync_file_range()
+ *     让内核开始回写，再映射下一段。
+ *
+ * 两种情况下进程占用的内存都与文件大小无关。映射时还会提示使用透明大页
+ * （MADV_HUGEPAGE），文件位于 tmpfs 上时可以减少缺页和 TLB 缺失，其他文件系统
+ * 会忽略这个提示。
+ *
+ * 窗口的边界都是 MMIO_WINDOW 的整数倍，从而也是页大小的整数倍。
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <assert.h>
+#include "mmio.h"
+
+/**
+ * MMIO_WINDOW - 每次预读、丢弃或映射的字节数，为 2MB 大页的整数倍
+ * MMIO_KEEP - 读时 pos 之前保持映射的字节数
+ */
+#define MMIO_WINDOW (4UL * 1024 * 1024)
+#define MMIO_KEEP (2 * MMIO_WINDOW)
+
+#define window_min(x, y) ((x) < (y) ? (x) : (y))
+
+/**
+ * window_read_advance() - 读取 pos 之前调用，按需移动读窗口
+ *
+ * win_lo 之前的部分已经丢弃，win_hi 之前的部分已经填好页表。
+ */
+static inline void window_read_advance(MMIO *x) {
+    if (x->pos + MMIO_WINDOW > x->win_hi && x->win_hi < x->size) {
+        size_t lo = x->win_hi;
+        size_t hi = window_min(x->size, (x->pos / MMIO_WINDOW + 2) * MMIO_WINDOW);
+        char *base = (char *)x->buf;
+        if (madvise(base + lo, hi - lo, MADV_POPULATE_READ) != 0)
+            madvise(base + lo, hi - lo, MADV_WILLNEED);
+        if (hi < x->size)
+            madvise(base + hi, window_min(MMIO_WINDOW, x->size - hi), MADV_WILLNEED);
+        x->win_hi = hi;
+    }
+    if (x->pos >= x->win_lo + MMIO_KEEP + MMIO_WINDOW) {
+        size_t drop = (x->pos - MMIO_KEEP) / MMIO_WINDOW * MMIO_WINDOW;
+        madvise((char *)x->buf + x->win_lo, drop - x->win_lo, MADV_DONTNEED);
+        x->win_lo = drop;
+    }
+}
+
+/**
+ * window_read_seek() - 读位置跳到 pos，丢弃原来的窗口，在 pos 处重新建立
+ */
+static inline void window_read_seek(MMIO *x, size_t pos) {
+    if (x->win_hi > x->win_lo)
+        madvise((char *)x->buf + x->win_lo, x->win_hi - x->win_lo, MADV_DONTNEED);
+    x->pos = window_min(pos, x->size);
+    x->win_lo = x->win_hi = x->pos / MMIO_WINDOW * MMIO_WINDOW;
+    window_read_advance(x);
+}
+
+/**
+ * window_prefetch() - 在其他线程中提前填好 [pos, pos + len) 的页表
+ *
+ * 与 window_read_advance() 做的一样，但不修改窗口，可以与读者同时进行。读者
+ * 到达时页已经在内存中，页表也已经填好，不会再因为缺页而停下。
+ */
+static inline void window_prefetch(MMIO *x, size_t pos, size_t len) {
+    if (pos >= x->size)
+        return;
+    size_t lo = pos & ~(size_t)4095;
+    size_t hi = window_min(pos + len, x->size);
+    char *base = (char *)x->buf;
+    if (madvise(base + lo, hi - lo, MADV_POPULATE_READ) != 0)
+        madvise(base + lo, hi - lo, MADV_WILLNEED);
+}
+
+/**
+ * window_read_open() - 映射整个文件用于读取，并建立第一个窗口
+ */
+static inline void window_read_open(MMIO *x, int option) {
+    x->buf = mmap(NULL, x->size, PROT_READ, option, x->fd, 0);
+    madvise(x->buf, x->size, MADV_SEQUENTIAL);
+    madvise(x->buf, x->size, MADV_HUGEPAGE);
+    x->win_lo = x->win_hi = 0;
+    window_read_advance(x);
+}
+
+/**
+ * window_write_map() - 映射从 win_lo 开始的一个窗口用于写入
+ *
+ * buf 指向窗口开头，文件中 off 处的数据位于 buf + (off - win_lo)。总长度未知时
+ * 先把文件延长到窗口末尾，映射超出文件末尾的部分会在写入时收到 SIGBUS。
+ */
+static inline void window_write_map(MMIO *x) {
+    x->win_hi = window_min(x->size, x->win_lo + MMIO_WINDOW);
+    if (x->win_hi == x->win_lo) {
+        x->buf = NULL;
+        return;
+    }
+    if (x->size == MMIO_SIZE_UNKNOWN) {
+        int ret = ftruncate(x->fd, x->win_hi);
+        assert(ret == 0);
+        (void)ret;
+    }
+    x->buf = mmap(NULL, x->win_hi - x->win_lo, PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            x->fd, x->win_lo);
+    madvise(x->buf, x->win_hi - x->win_lo, MADV_HUGEPAGE);
+}
+
+/**
+ * window_write_unmap() - 解除当前写窗口的映射，并开始回写其中的数据
+ */
+static inline void window_write_unmap(MMIO *x) {
+    if (x->buf == NULL)
+        return;
+    munmap(x->buf, x->win_hi - x->win_lo);
+    sync_file_range(x->fd, x->win_lo, x->win_hi - x->win_lo, SYNC_FILE_RANGE_WRITE);
+    x->buf = NULL;
+}
+
+/**
+ * window_write() - 将 buf 中的 size 字节写到 pos 处，写满窗口时映射下一段
+ */
+static inline size_t window_write(const void *buf, size_t size, MMIO *x) {
+    size_t total = 0;
+    size = window_min(size, x->size - x->pos);
+    while (total < size) {
+        if (x->pos == x->win_hi) {
+            window_write_unmap(x);
+            x->win_lo = x->win_hi;
+            window_write_map(x);
+        }
+        size_t len = window_min(size - total, x->win_hi - x->pos);
+        memcpy((char *)x->buf + (x->pos - x->win_lo), (const char *)buf + total, len);
+        total += len;
+        x->pos += len;
+    }
+    return total;
+}
+
+#endif
@@ -4,27 +4,24 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include "mmio.h"
+#include "mmio-window.h"
 #include <string.h>
 #include <assert.h>
 
 #define MMIO_RDMAP_OPTION (MAP_NORESERVE | MAP_PRIVATE)
-#define MMIO_RDMAP_MADVICE (MADV_SEQUENTIAL | MADV_WILLNEED)
 #define MMIO_RDMAP_FADVICE (POSIX_FADV_SEQUENTIAL | POSIX_FADV_WILLNEED | POSIX_FADV_NOREUSE)
-#define MMIO_WRMAP_OPTION (MAP_NORESERVE | MAP_SHARED)
-#define MMIO_WRMAP_MADVICE (0)
 #define MMIO_WRMAP_FADVICE (0)
 
 #define min(x, y) ((x) < (y) ? (x) : (y))
 
-void mmrd_open(MMIO *x, const char *fname, size_t size) {
-    x->fd = open(fname, O_RDONLY);
+void mmrd_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    x->fd = openat(dir, fname, O_RDONLY);
     if (x->fd == -1)
         return;
     x->size = size;
     x->pos = 0;
     posix_fadvise64(x->fd, 0, x->size, MMIO_RDMAP_FADVICE);
-    x->buf = mmap(NULL, x->size, PROT_READ, MMIO_RDMAP_OPTION, x->fd, 0);
-    madvise(x->buf, x->size, MMIO_RDMAP_MADVICE);
+    window_read_open(x, MMIO_RDMAP_OPTION);
 }
 
 void mmrd_close(MMIO *x) {
@@ -35,34 +32,76 @@ void mmrd_close(MMIO *x) {
 }
 
 size_t mmread(void *buf, size_t size, MMIO *x) {
+    window_read_advance(x);
     size_t len = min(size, x->size - x->pos);
     memcpy(buf, x->buf + x->pos, len);
     x->pos += len;
     return len;
 }
 
-void mmwr_open(MMIO *x, const char *fname, size_t size) {
-    x->fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+/**
+ * mmview() - 不复制数据，直接返回文件当前位置在映射中的地址
+ *
+ * @len - 实际可读的字节数，文件剩余数据不足 size 时小于 size
+ *
+ * 与 mmread() 一样会推进文件位置。返回的指针在 mmrd_close() 之前有效，且只读。
+ */
+const void *mmview(size_t size, MMIO *x, size_t *len) {
+    window_read_advance(x);
+    const char *result = (const char *)x->buf + x->pos;
+    *len = min(size, x->size - x->pos);
+    x->pos += *len;
+    return result;
+}
+
+/**
+ * mmrd_seek() - 将读位置移动到文件中的 pos 处
+ *
+ * 只能向前移动。
+ */
+void mmrd_seek(MMIO *x, size_t pos) {
+    window_read_seek(x, pos);
+}
+
+void mmrd_prefetch(MMIO *x, size_t pos, size_t len) {
+    window_prefetch(x, pos, len);
+}
+
+void mmwr_openat(MMIO *x, int dir, const char *fname, size_t size) {
+    x->fd = openat(dir, fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (x->fd == -1)
         return;
     x->size = size;
     x->pos = 0;
-    fallocate(x->fd, 0, 0, x->size);
+    if (size != MMIO_SIZE_UNKNOWN)
+        fallocate(x->fd, 0, 0, x->size);
     posix_fadvise64(x->fd, 0, x->size, MMIO_WRMAP_FADVICE);
-    x->buf = mmap(NULL, x->size, PROT_WRITE, MMIO_WRMAP_OPTION, x->fd, 0);
-    madvise(x->buf, x->size, MMIO_WRMAP_MADVICE);
+    x->win_lo = 0;
+    window_write_map(x);
+}
+
+void mmwr_open_at(MMIO *x, const char *fname, size_t size, size_t pos) {
+    x->fd = open(fname, O_RDWR);
+    if (x->fd == -1)
+        return;
+    x->size = size;
+    x->pos = pos;
+    x->win_lo = pos / MMIO_WINDOW * MMIO_WINDOW;
+    window_write_map(x);
 }
 
 void mmwr_close(MMIO *x) {
     assert(x->fd != -1);
-    munmap(x->buf, x->size);
+    window_write_unmap(x);
+    if (x->size == MMIO_SIZE_UNKNOWN) {
+        int ret = ftruncate(x->fd, x->pos);
+        assert(ret == 0);
+        (void)ret;
+    }
     close(x->fd);
     x->fd = -1;
 }
 
 size_t mmwrite(void *buf, size_t size, MMIO *x) {
-    size_t len = min(size, x->size - x->pos);
-    memcpy(x->buf + x->pos, buf, len);
-    x->pos += len;
-    return len;
+    return window_write(buf, size, x);
 }
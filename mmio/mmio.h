@@ -3,8 +3,17 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
 #include <pthread.h>
 
+/**
+ * MMIO_SIZE_UNKNOWN - 作为 mmwr_open() 的 size，表示写入的总长度事先未知
+ *
+ * 此时不预先分配空间，mmwr_close() 之后文件的长度即实际写入的字节数。
+ */
+#define MMIO_SIZE_UNKNOWN (SIZE_MAX)
+
 typedef struct {
     int fd;
     size_t size;
@@ -14,14 +23,44 @@ typedef struct {
     FILE *fp;
     pthread_t tid;
     int pipefd[2];
+    struct MMRing *ring;
+    size_t buf_off;
+    size_t buf_len;
+    size_t win_lo;
+    size_t win_hi;
 } MMIO;
 
 
-void mmrd_open(MMIO *x, const char *fname, size_t size);
+/*
+ * 打开目录 dir 中的文件 fname，dir 为 AT_FDCWD 时与 mmrd_open() 相同。批量读写
+ * 许多文件时，各个磁盘目录只需打开一次，见 evenodd.c 中的 batch_all()。
+ */
+void mmrd_openat(MMIO *x, int dir, const char *fname, size_t size);
 void mmrd_close(MMIO *x);
 size_t mmread(void *buf, size_t size, MMIO *x);
-void mmwr_open(MMIO *x, const char *fname, size_t size);
+const void *mmview(size_t size, MMIO *x, size_t *len);
+void mmrd_seek(MMIO *x, size_t pos);
+/*
+ * 提示即将读取文件中从 pos 开始的 len 个字节，让它们提前进入内存。可以在其他线
+ * 程中与 mmread() 同时调用，不改变读位置。
+ */
+void mmrd_prefetch(MMIO *x, size_t pos, size_t len);
+void mmwr_openat(MMIO *x, int dir, const char *fname, size_t size);
+/*
+ * 打开已经存在的文件，从 pos 处写到 size 为止，不截断也不预先分配空间。多个线
+ * 程可以各自打开同一个文件中互不重叠的几段同时写入。pos 和 size 应按页对齐，
+ * 除非 size 就是文件末尾。
+ */
+void mmwr_open_at(MMIO *x, const char *fname, size_t size, size_t pos);
 void mmwr_close(MMIO *x);
 size_t mmwrite(void *buf, size_t size, MMIO *x);
 
+static inline void mmrd_open(MMIO *x, const char *fname, size_t size) {
+    mmrd_openat(x, AT_FDCWD, fname, size);
+}
+
+static inline void mmwr_open(MMIO *x, const char *fname, size_t size) {
+    mmwr_openat(x, AT_FDCWD, fname, size);
+}
+
 #endif
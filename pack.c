@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "packet.h"
+#include "util.h"
+#include "chunk.h"
+#include "repair.h"
+#include "kernel.h"
+#include "metadata.h"
+#include "range.h"
+#include "pack.h"
+#include "mmio/mmio.h"
+#include "mmio/mmio-stream.h"
+
+#define PACK_VERSION (1)
+
+void pack_segment_name(char name[NAME_MAX + 1], unsigned seg) {
+    snprintf(name, NAME_MAX + 1, PACK_PREFIX "%u", seg);
+}
+
+/**
+ * pack_segment_number() - 磁盘中名为 name 的文件是否是容器段，是时得到其编号
+ */
+int pack_segment_number(const char *name, unsigned *seg) {
+    char *end;
+    if (strncmp(name, PACK_PREFIX, strlen(PACK_PREFIX)) != 0)
+        return 0;
+    name += strlen(PACK_PREFIX);
+    unsigned long n = strtoul(name, &end, 10);
+    if (*name < '0' || *name > '9' || *end != '\0')
+        return 0;
+    *seg = (unsigned)n;
+    return 1;
+}
+
+/**
+ * pack_next_segment() - 目录中已有的容器段之后的第一个编号
+ *
+ * 容器段本身与打包的文件都登记在目录中，不必遍历磁盘目录；某个磁盘损坏后还没
+ * 有修复时，其中的容器段也不会被重复使用。
+ */
+unsigned pack_next_segment(const CatalogIndex *catalog) {
+    unsigned next = 0, seg;
+    for (size_t k = 0; k < catalog->num; ++k) {
+        const CatalogEntry *e = &catalog->entries[k];
+        if (e->packed)
+            next = MAX(next, e->seg + 1);
+        else if (pack_segment_number(e->name, &seg))
+            next = MAX(next, seg + 1);
+    }
+    return next;
+}
+
+/**
+ * pack_claim_segment() - 为新的容器段占用一个编号
+ *
+ * @dir - 磁盘 0 的目录
+ * @next - 从这里开始尝试，返回后为下一次开始尝试的编号
+ *
+ * 在磁盘 0 中以 O_EXCL 建立容器段的文件，同时打包的其他进程已经建立时换下一个
+ * 编号，所以不同的进程不会写入同一个容器段。中断的打包留下的文件同样跳过。
+ */
+unsigned pack_claim_segment(int dir, unsigned *next) {
+    char name[NAME_MAX + 1];
+    for (;; ++*next) {
+        pack_segment_name(name, *next);
+        int fd = openat(dir, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd != -1) {
+            close(fd);
+            return (*next)++;
+        }
+        if (errno != EEXIST) {
+            perror(name);
+            exit(-1);
+        }
+    }
+}
+
+/**
+ * pack_segment() - 把 num 个小文件打包成编号为 seg 的容器段，写入各个磁盘
+ *
+ * @dirs - 各个磁盘目录，前 p+2 个都已建好
+ * @cell - 单元大小，为 0 时按容器段的长度选择，与 get_raw_metadata() 相同
+ *
+ * 整个容器段先在内存中拼好，每个 chunk 直接指向其中的数据，不再复制，计算出校
+ * 验列后依次写入，每个磁盘只有一个文件，顺序写入。文件在列出之后变短或消失时，
+ * 索引中记录实际读到的长度，其余部分为零。
+ *
+ * 返回容器段的 Metadata，并在 files 中填好各个文件的位置，由调用者登记到目录中。
+ */
+Metadata pack_segment(const int dirs[], unsigned seg, int p, size_t cell, PackFile files[], size_t num) {
+    char name[NAME_MAX + 1];
+    MMIO out[PMAX + 2];
+    size_t payload = 0, index = 0;
+
+    for (size_t k = 0; k < num; ++k) {
+        payload += files[k].size;
+        index += sizeof(PackRecord) + strlen(files[k].name) + 1;
+    }
+    Metadata meta = get_raw_metadata(payload + index + sizeof(PackFooter), p, cell);
+    size_t raw = meta.cell * p * (p - 1);
+    size_t chunks = meta.full_chunk_num + (meta.last_chunk_data_size != 0);
+    char *buf = calloc(chunks, raw);
+    assert(buf != NULL);
+
+    char *pos = buf + payload;
+    PackRecord rec = { 0, 0 };
+    for (size_t k = 0; k < num; ++k) {
+        MMIO in = { .fd = open(files[k].path, O_RDONLY), .pos = 0 };
+        rec.length = 0;
+        if (in.fd == -1) {
+            perror(files[k].path);
+        } else {
+            rec.length = stream_read(buf + rec.offset, files[k].size, &in);
+            close(in.fd);
+        }
+        files[k].offset = rec.offset;
+        files[k].length = rec.length;
+        size_t len = strlen(files[k].name) + 1;
+        memcpy(pos, &rec, sizeof(rec));
+        memcpy(pos + sizeof(rec), files[k].name, len);
+        pos += sizeof(rec) + len;
+        rec.offset += files[k].size;
+    }
+    PackFooter footer = { PACK_MAGIC, PACK_VERSION, payload, num };
+    memcpy(pos, &footer, sizeof(footer));
+
+    pack_segment_name(name, seg);
+    metadata_set_rotate(&meta, name);
+    for (int i = 0; i < p + 2; ++i) {
+        mmwr_openat(&out[i], dirs[disk_of(&meta, i)], name, disk_file_size(&meta));
+        assert(out[i].fd != -1);
+        write_metadata(meta, &out[i]);
+    }
+
+    Chunk *chunk = chunk_new(p, meta.cell / sizeof(Packet), 1);
+    const Schedule *sched = schedule_get(p, p, p + 1);
+    KernelFn kernel = kernel_get(p, chunk->cell);
+    for (size_t n = 0; n < chunks; ++n) {
+        chunk->raw = (Packet *)(buf + n * raw);
+        if (kernel != NULL)
+            kernel(chunk, p, p + 1);
+        else
+            schedule_run(sched, chunk);
+        write_cooked_chunk(chunk, out, NULL);
+    }
+    free(chunk);
+    free(buf);
+
+    for (int i = 0; i < p + 2; ++i)
+        mmwr_close(&out[i]);
+    return meta;
+}
+
+/**
+ * pack_read_index() - 读出编号为 seg、长度为 size 的容器段中的索引
+ *
+ * @files - 得到索引中的各个文件，只填写 name offset 和 length
+ * @buf - 得到保存文件名的缓冲区，name 指向其中，与 files 一起由调用者释放
+ *
+ * 返回文件数量。容器段没有写完（PackFooter 不合法）或者已经无法恢复时返回
+ * (size_t)-1，files 和 buf 为 NULL。
+ */
+size_t pack_read_index(unsigned seg, size_t size, PackFile **files, char **buf) {
+    char name[NAME_MAX + 1];
+    PackFooter footer;
+
+    *files = NULL;
+    *buf = NULL;
+    pack_segment_name(name, seg);
+    if (size < sizeof(footer))
+        return (size_t)-1;
+    size_t end = size - sizeof(footer);
+    if (read_range(name, end, sizeof(footer), &footer) != sizeof(footer)
+            || footer.magic != PACK_MAGIC || footer.version != PACK_VERSION || footer.index > end)
+        return (size_t)-1;
+
+    size_t len = end - footer.index;
+    *buf = malloc(len + 1);
+    assert(*buf != NULL);
+    if (read_range(name, footer.index, len, *buf) != len) {
+        free(*buf);
+        *buf = NULL;
+        return (size_t)-1;
+    }
+    (*buf)[len] = '\0';
+
+    /* 每条记录至少占 sizeof(PackRecord) + 1 个字节，count 不可信 */
+    size_t num = MIN(footer.count, len / (sizeof(PackRecord) + 1));
+    *files = malloc(MAX(num, 1) * sizeof(PackFile));
+    assert(*files != NULL);
+    PackRecord rec;
+    size_t pos = 0, k = 0;
+    for (size_t n = 0; n < num && pos + sizeof(rec) < len; ++n) {
+        memcpy(&rec, *buf + pos, sizeof(rec));
+        const char *fname = *buf + pos + sizeof(rec);
+        pos += sizeof(rec) + strlen(fname) + 1;
+        if (*fname != '\0' && rec.offset <= footer.index && rec.length <= footer.index - rec.offset)
+            (*files)[k++] = (PackFile) { .name = fname, .offset = rec.offset, .length = rec.length };
+    }
+    return k;
+}
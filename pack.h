@@ -0,0 +1,86 @@
+#ifndef PACK_H_
+#define PACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/limits.h>
+#include "metadata.h"
+#include "catalog.h"
+
+/**
+ * 小文件打包
+ *
+ * 单独保存时，哪怕只有 1 个字节的文件，在 p+2 个磁盘中也各占一个文件，各有一份
+ * Metadata 和一个补零的 record，元数据和 inode 的开销远大于数据本身。打包时把
+ * 许多小文件首尾相接，连同索引拼成一个容器段，容器段作为一个普通的文件编码后
+ * 写入各个磁盘：
+ *
+ *   [文件 0][文件 1]...[文件 n-1][索引][PackFooter]
+ *
+ * 索引依次记录每个文件的 PackRecord 及其以 '\0' 结尾的名字（磁盘中使用的名字，
+ * 即 cooked_name() 之后的名字）。PackFooter 位于容器段的最后，记录索引的位置。
+ *
+ * 容器段与单独保存的文件格式完全相同，repair 操作不需要区分两者；读取其中的文
+ * 件只是读取容器段中的一段，见 read_range()。每个文件在容器段中的位置也登记在
+ * 目录中（见 catalog.h），读取时只需查目录，不必读出各个容器段的索引；容器段中
+ * 的索引只在为旧的磁盘建立目录时才读取。同名的文件以最后写入的为准：打包时
+ * 删除单独保存的旧文件，之后再单独写入时，读取时先找到的单独保存的文件就是新
+ * 的；同一个名字在多个容器段中出现时，目录中编号大的容器段的记录在后。
+ *
+ * 新的容器段在目录中已有的编号之后继续编号，并在磁盘 0 中以 O_EXCL 建立文件占
+ * 用编号，多个进程可以同时打包，见 pack_claim_segment()。
+ */
+
+/**
+ * PACK_PREFIX - 容器段在各个磁盘中的名字的前缀，其后是十进制的编号
+ */
+#define PACK_PREFIX ".evenodd-pack-"
+
+#define PACK_MAGIC (0x4b434150u) /* "PACK" */
+
+/**
+ * PackRecord - 索引中一个文件在容器段中的位置，其后紧跟文件名
+ */
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} PackRecord;
+
+/**
+ * PackFooter - 容器段最后的若干字节
+ *
+ * @index - 索引在容器段中的偏移，索引一直延续到 PackFooter 之前
+ * @count - 索引中的文件数量
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t index;
+    uint64_t count;
+} PackFooter;
+
+/**
+ * PackFile - 容器段中的一个小文件
+ *
+ * @path - 打包时从这里读取文件内容
+ * @name - 文件在磁盘中使用的名字
+ * @size - 打包前列出的文件长度
+ * @offset @length - 文件在容器段中的位置和实际长度，由 pack_segment() 或
+ *                   pack_read_index() 填写
+ */
+typedef struct {
+    const char *path;
+    const char *name;
+    size_t size;
+    size_t offset;
+    size_t length;
+} PackFile;
+
+void pack_segment_name(char name[NAME_MAX + 1], unsigned seg);
+int pack_segment_number(const char *name, unsigned *seg);
+unsigned pack_next_segment(const CatalogIndex *catalog);
+unsigned pack_claim_segment(int dir, unsigned *next);
+Metadata pack_segment(const int dirs[], unsigned seg, int p, size_t cell, PackFile files[], size_t num);
+size_t pack_read_index(unsigned seg, size_t size, PackFile **files, char **buf);
+
+#endif
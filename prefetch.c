@@ -0,0 +1,75 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prefetch.h"
+#include "util.h"
+
+/**
+ * PREFETCH_QUEUE - 进度队列的长度
+ *
+ * 进度只需要最新的一个，队列只是为了让读线程不必等待预读线程。
+ */
+#define PREFETCH_QUEUE (8)
+
+static void *prefetch_thread(void *data) {
+    Prefetch *x = (Prefetch *)data;
+    size_t step = MAX(x->window / 4, 1);
+    ItemType item;
+    while ((item = SpscQueue_pop(&x->progress)) != NULL) {
+        size_t done = (size_t)(uintptr_t)item - 1;
+        size_t target = MIN(done + x->window, x->count);
+        while (x->issued < target) {
+            size_t n = MIN(target - x->issued, step);
+            for (int k = 0; k < x->num; ++k)
+                mmrd_prefetch(x->files[k], x->base + x->issued * x->record, n * x->record);
+            x->issued += n;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * prefetch_start() - 启动预读线程，立即开始读入最前面的 window 个 chunk
+ *
+ * @files - 各个磁盘文件，复制一份，调用者的数组可以是临时的
+ */
+void prefetch_start(Prefetch *x, MMIO *files[], int num, size_t base, size_t record, size_t count,
+        size_t window) {
+    x->files = malloc(num * sizeof(MMIO *));
+    assert(x->files != NULL);
+    memcpy(x->files, files, num * sizeof(MMIO *));
+    x->num = num;
+    x->base = base;
+    x->record = record;
+    x->count = count;
+    x->window = MAX(window, 1);
+    x->issued = 0;
+    x->told = 0;
+    x->progress = SpscQueue_new(PREFETCH_QUEUE);
+    SpscQueue_push(&x->progress, (ItemType)(uintptr_t)1);
+    pthread_create(&x->tid, NULL, prefetch_thread, x);
+}
+
+/**
+ * prefetch_advance() - 读线程已经按顺序读完了 done 个 chunk
+ *
+ * 从不阻塞。
+ */
+void prefetch_advance(Prefetch *x, size_t done) {
+    if (done < x->told + MAX(x->window / 4, 1) || SpscQueue_full(&x->progress))
+        return;
+    SpscQueue_push(&x->progress, (ItemType)(uintptr_t)(done + 1));
+    x->told = done;
+}
+
+/**
+ * prefetch_stop() - 通知预读线程结束并等待它退出
+ */
+void prefetch_stop(Prefetch *x) {
+    SpscQueue_push(&x->progress, NULL);
+    pthread_join(x->tid, NULL);
+    SpscQueue_drop(&x->progress);
+    free(x->files);
+}
@@ -0,0 +1,48 @@
+#ifndef PREFETCH_H_
+#define PREFETCH_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include "spsc/spsc.h"
+#include "mmio/mmio.h"
+
+/**
+ * Prefetch - 为所有完好的磁盘提前读入即将用到的 record
+ *
+ * @files @num - 需要读取的各个磁盘文件
+ * @base - 第一个 chunk 在磁盘文件中的偏移
+ * @record - 每个 chunk 在每个磁盘文件中所占的字节数
+ * @count - 需要读取的 chunk 总数
+ * @window - 每个磁盘提前读入的 chunk 数量
+ * @issued - 已经提示读入的 chunk 数量，只由预读线程读写
+ * @told - 上次告知预读线程的进度，只由读线程读写
+ * @progress - 读线程告知的进度，即已经读完的 chunk 数量加一，NULL 表示结束
+ *
+ * 读线程按顺序依次读取各个磁盘，任何一个磁盘上的缺页都会让整个 chunk 停下，
+ * 内核根据顺序访问做的预读也难以同时照顾上百个文件。预读线程始终让每个磁盘
+ * 上读线程前方 window 个 chunk 的数据留在内存中（见 mmrd_prefetch()），读线程
+ * 到达时不再等待磁盘。
+ *
+ * 各个磁盘每次只向前推进 window 的四分之一，轮流进行，使它们的预读进度大致
+ * 相同。读线程每前进四分之一个 window 告知一次进度，队列满时跳过，之后的进度
+ * 会覆盖它，所以读线程从不因预读而等待。
+ */
+typedef struct Prefetch {
+    MMIO **files;
+    int num;
+    size_t base;
+    size_t record;
+    size_t count;
+    size_t window;
+    size_t issued;
+    size_t told;
+    SpscQueue progress;
+    pthread_t tid;
+} Prefetch;
+
+void prefetch_start(Prefetch *x, MMIO *files[], int num, size_t base, size_t record, size_t count,
+        size_t window);
+void prefetch_advance(Prefetch *x, size_t done);
+void prefetch_stop(Prefetch *x);
+
+#endif
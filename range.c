@@ -0,0 +1,112 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/limits.h>
+
+#include "packet.h"
+#include "util.h"
+#include "chunk.h"
+#include "repair.h"
+#include "kernel.h"
+#include "metadata.h"
+#include "range.h"
+
+/**
+ * read_range() - 读取原始文件中从 offset 开始的 length 个字节，存入 buf
+ *
+ * @name - 磁盘中的文件名，由调用者按 lookup_cooked_file() 等找到
+ * @buf - 至少能容纳 length 个字节
+ *
+ * 返回实际读到的字节数，超出文件末尾的部分不读取。文件不存在时返回
+ * RANGE_NOENT，无法恢复时返回 RANGE_CORRUPT，由调用者报告。
+ *
+ * 磁盘文件的布局完全由 Metadata 决定：原始文件中的第 n 个 raw chunk 对应每个磁
+ * 盘中的第 n 个 record，位于 Metadata 之后 n * (p-1) * cell 字节处。所以只需
+ * 将各个磁盘定位到覆盖这段数据的第一个 chunk，逐个读入这些 chunk，按需修复后
+ * 复制出需要的部分，其余的 chunk 既不读也不算。
+ *
+ * 与 read 操作一样，磁盘都完好时不读校验列，也不做任何计算。
+ */
+size_t read_range(const char *name, size_t offset, size_t length, void *buf) {
+    MMIO in[PMAX + 2];
+    int bad_disks[2] = { -1, -1 };
+    int bad_disk_num = 0;
+
+    assert(name != NULL);
+    Metadata meta;
+    if (!get_cooked_file_metadata_at(NULL, name, &meta))
+        return RANGE_NOENT;
+
+    if (offset >= meta.size)
+        return 0;
+    length = MIN(length, meta.size - offset);
+    if (length == 0)
+        return 0;
+
+    int p = meta.p;
+    size_t record = meta.cell * (p - 1);
+    size_t raw = record * p;
+    size_t first = offset / raw;
+    size_t last = (offset + length - 1) / raw;
+
+    for (int i = 0; i < p + 2; ++i) {
+        char path[PATH_MAX];
+        sprintf(path, "disk_%d/%s", disk_of(&meta, i), name);
+        mmrd_open(&in[i], path, disk_file_size(&meta));
+        if (in[i].fd != -1) {
+            mmrd_seek(&in[i], meta.header_size + first * record);
+        } else {
+            if (bad_disk_num == 2) {
+                for (int k = 0; k < i; ++k) {
+                    if (in[k].fd != -1)
+                        mmrd_close(&in[k]);
+                }
+                return RANGE_CORRUPT;
+            }
+            bad_disks[bad_disk_num++] = i;
+        }
+    }
+
+    /* 只保留修复所需的磁盘，规则与 read 操作相同 */
+    if (bad_disk_num == 0) {
+        mmrd_close(&in[p]);
+        mmrd_close(&in[p + 1]);
+    } else if (bad_disk_num == 1) {
+        if (bad_disks[0] == p + 1) {
+            mmrd_close(&in[p]);
+            bad_disks[0] = p;
+        } else {
+            mmrd_close(&in[p + 1]);
+        }
+        bad_disks[1] = p + 1;
+    }
+
+    const Schedule *sched = NULL;
+    KernelFn kernel = NULL;
+    if (bad_disk_num != 0) {
+        sched = schedule_get(p, bad_disks[0], bad_disks[1]);
+        kernel = kernel_get(p, meta.cell / sizeof(Packet));
+    }
+
+    Chunk *chunk = chunk_new(p, meta.cell / sizeof(Packet), 1);
+    for (size_t n = first; n <= last; ++n) {
+        read_cooked_chunk(chunk, in);
+        if (kernel != NULL)
+            kernel(chunk, bad_disks[0], bad_disks[1]);
+        else if (sched != NULL)
+            schedule_run(sched, chunk);
+
+        /* 这个 chunk 与 [offset, offset + length) 的交集 */
+        size_t lo = MAX(offset, n * raw);
+        size_t hi = MIN(offset + length, (n + 1) * raw);
+        memcpy((char *)buf + (lo - offset), (char *)chunk->data + (lo - n * raw), hi - lo);
+    }
+    free(chunk);
+
+    for (int i = 0; i < p + 2; ++i) {
+        if (in[i].fd != -1)
+            mmrd_close(&in[i]);
+    }
+    return length;
+}
@@ -0,0 +1,17 @@
+#ifndef RANGE_H_
+#define RANGE_H_
+
+#include <stddef.h>
+
+/**
+ * read_range() 的错误返回值
+ *
+ * RANGE_NOENT - 文件不存在
+ * RANGE_CORRUPT - 损坏的磁盘超过两个，无法恢复
+ */
+#define RANGE_NOENT ((size_t)-1)
+#define RANGE_CORRUPT ((size_t)-2)
+
+size_t read_range(const char *name, size_t offset, size_t length, void *buf);
+
+#endif
@@ -1,182 +1,260 @@
 #include "chunk.h"
 #include "packet.h"
 #include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include "simd.h"
 #include "util.h"
 #include "repair.h"
 
 /**
- * cook_chunk_r1() - 计算第一列校验值，即原始数据每行的异或值。
+ * C() - 第 row 行第 col 列的单元编号
+ * T() - 第 k 个临时单元的编号
  */
-void cook_chunk_r1(Chunk *chunk) {
-    assert(chunk != NULL);
-    int m = chunk->p;
-    for (int l = 0; l <= m - 2; ++l) {
-        PZERO(AT(l, m));
-        for (int t = 0; t <= m - 1; ++t) {
-            PXOR(AT(l, m), AT(l, t));
+#define C(row, col) ((unsigned int)((col) * (m - 1) + (row)))
+#define T(k) C(k, m + 2)
+
+/**
+ * emit() - 向调度表末尾追加对单个单元的运算
+ *
+ * 若新的运算恰好接在上一条运算之后（目标和源都是下一个单元），则直接延长上一
+ * 条运算，使其覆盖连续的多个单元。这样生成时可以按论文逐个单元描述，执行时却
+ * 是对整段连续内存的运算。合并后目标与源区间重叠时不合并，保证与逐个单元执行
+ * 的结果相同。
+ *
+ * 前 p 列与其余单元可能不在同一块内存中（见 Chunk 中的 raw），所以也不跨越两者
+ * 的边界合并。
+ */
+static void emit(Schedule *s, size_t *cap, int op, unsigned int dst, unsigned int src) {
+    if (s->num != 0) {
+        XorOp *last = &s->ops[s->num - 1];
+        unsigned int raw = s->p * (s->p - 1);
+        int contiguous = last->op == op && last->dst + last->len == dst
+            && (op == OP_ZERO || last->src + last->len == src);
+        int overlap = op != OP_ZERO
+            && last->dst < src + 1 && last->src < dst + 1;
+        int split = (last->dst < raw) != (dst < raw)
+            || (op != OP_ZERO && (last->src < raw) != (src < raw));
+        if (contiguous && !overlap && !split) {
+            last->len += 1;
+            return;
         }
     }
+    if (s->num == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        s->ops = realloc(s->ops, *cap * sizeof(XorOp));
+        assert(s->ops != NULL);
+    }
+    s->ops[s->num++] = (XorOp) { .op = op, .dst = dst, .src = src, .len = 1 };
 }
 
 /**
- * cook_chunk_r2() - 计算第二列校验值，即各种对角线神奇魔法算出来的值。
+ * emit_shifted() - dst[k] ^= ATR(M(k + s), col)，k 取 [0, n)
+ *
+ * @dst - n 个连续单元中第一个单元的编号
+ *
+ * 对角线相关的运算都可以写成这个形式。跳过全零的第 p-1 行。
  */
-void cook_chunk_r2(Chunk *chunk) {
-    assert(chunk != NULL);
-    Packet S;
-    PZERO(S);
-    int m = chunk->p;
-    for (int t = 1; t <= m - 1; ++t)
-        PXOR(S, AT(m - 1 - t, t));
-    for (int l = 0; l <= m - 2; ++l)
-        PASGN(AT(l, m + 1), S);
-    for (int t = 0; t <= m - 1; ++t) {
-        for (int l = 0; l < (m - 1) - t; ++l) {
-            PXOR(AT(l + t, m + 1), AT(l, t));
-        }
-        for (int l = m - t; l <= m - 2; ++l) {
-            PXOR(AT(l + t - m, m + 1), AT(l, t));
-        }
+static void emit_shifted(Schedule *b, size_t *cap, unsigned int dst, int n, int col, int s) {
+    int m = b->p;
+    for (int k = 0; k < n; ++k) {
+        int row = M(k + s);
+        if (row != m - 1)
+            emit(b, cap, OP_XOR, dst + k, C(row, col));
     }
 }
 
-void repair_2bad_case1(Chunk *chunk, UNUSED_PARAM int i, UNUSED_PARAM int j) {
-    /* i == m && j == m + 1 */
-    assert(chunk != NULL);
-    Packet S;
-    PZERO(S);
-    int m = chunk->p;
-
+/**
+ * emit_r1() - 计算第一列校验值，即原始数据每行的异或值。
+ */
+static void emit_r1(Schedule *b, size_t *cap) {
+    int m = b->p;
+    for (int l = 0; l <= m - 2; ++l)
+        emit(b, cap, OP_COPY, C(l, m), C(l, 0));
     for (int t = 1; t <= m - 1; ++t)
-        PXOR(S, AT(m - 1 - t, t));
+        for (int l = 0; l <= m - 2; ++l)
+            emit(b, cap, OP_XOR, C(l, m), C(l, t));
+}
 
-    for (int l = 0; l <= m - 2; ++l) {
-        PASGN(AT(l, m + 1), S);
-        PASGN(AT(l, m), AT(l, m - l - 1));
-    }
+/**
+ * emit_r2() - 计算第二列校验值，即各种对角线神奇魔法算出来的值。
+ */
+static void emit_r2(Schedule *b, size_t *cap) {
+    int m = b->p;
+    emit(b, cap, OP_COPY, T(0), C(m - 2, 1));
+    for (int t = 2; t <= m - 1; ++t)
+        emit(b, cap, OP_XOR, T(0), C(m - 1 - t, t));
+    for (int l = 0; l <= m - 2; ++l)
+        emit(b, cap, OP_COPY, C(l, m + 1), T(0));
+    for (int t = 0; t <= m - 1; ++t)
+        emit_shifted(b, cap, C(0, m + 1), m - 1, t, M(-t));
+}
 
-    for (int t = 0; t <= m - 1; ++t) {
-        for (int l = 0; l < (m - 1) - t; ++l) {
-            PXOR(AT(l, m), AT(l, t));
-            PXOR(AT(l + t, m + 1), AT(l, t));
-        }
-        for (int l = m - t; l <= m - 2; ++l) {
-            PXOR(AT(l, m), AT(l, t));
-            PXOR(AT(l + t - m, m + 1), AT(l, t));
-        }
-    }
+static void emit_case1(Schedule *b, size_t *cap) {
+    /* i == m && j == m + 1 */
+    emit_r1(b, cap);
+    emit_r2(b, cap);
 }
 
-void repair_2bad_case2(Chunk *chunk, int i, UNUSED_PARAM int j) {
+static void emit_case2(Schedule *b, size_t *cap) {
     /* i < m && j == m */
-    assert(chunk != NULL);
-    assert(i < chunk->p);
-    int m = chunk->p;
-    Packet S;
+    int m = b->p, i = b->i;
     int ref_diagonal = M(i - 1);
-    PASGN(S, ATR(ref_diagonal, m + 1));
-    for (int l = 0; l <= ref_diagonal; ++l) {
-        PXOR(S, ATR(ref_diagonal - l, l));
-    }
-    for (int l = ref_diagonal + 1; l < m - 1; ++l) {
-        PXOR(S, ATR(m + ref_diagonal - l, l));
-    }
-    if (ref_diagonal < m - 2)
-        PXOR(S, ATR(ref_diagonal + 1, m - 1));
-
-    // recover column i
-    for (int k = 0; k < m - i && k <= m - 2; ++k) {
-        PASGN(AT(k, i), S);
-        PXOR(AT(k, i), ATR(i + k, m + 1));
-
-        /* l < i <= k + i < m */
-        for (int l = 0; l < i; ++l)
-            PXOR(AT(k, i), ATR(k + i - l, l));
-        /* i <= k + i < m */
-        for (int l = i + 1; l <= m - 1; ++l)
-            PXOR(AT(k, i), ATR(M(k + i - l), l));
+
+    /* S 为 ref_diagonal 这条对角线上所有单元的异或值 */
+    emit(b, cap, OP_ZERO, T(0), 0);
+    if (ref_diagonal < m - 1)
+        emit(b, cap, OP_XOR, T(0), C(ref_diagonal, m + 1));
+    for (int l = 0; l <= m - 1; ++l) {
+        int row = M(ref_diagonal - l);
+        if (l != i && row != m - 1)
+            emit(b, cap, OP_XOR, T(0), C(row, l));
     }
-    for (int k = m - i; k <= m - 2; ++k) {
-        PASGN(AT(k, i), S);
-        PXOR(AT(k, i), ATR(i + k - m, m + 1));
-        for (int l = 0; l < i; ++l)
-            PXOR(AT(k, i), ATR(M(k + i - l), l));
-        for (int l = i + 1; l <= m - 1; ++l)
-            PXOR(AT(k, i), ATR(M(k + i - l), l));
+
+    /* AT(k, i) = S ^ ATR(M(k + i), m + 1) ^ ATR(M(k + i - l), l)，l != i */
+    for (int k = 0; k <= m - 2; ++k)
+        emit(b, cap, OP_COPY, C(k, i), T(0));
+    emit_shifted(b, cap, C(0, i), m - 1, m + 1, i);
+    for (int l = 0; l <= m - 1; ++l) {
+        if (l != i)
+            emit_shifted(b, cap, C(0, i), m - 1, l, M(i - l));
     }
-    cook_chunk_r1(chunk);
+    emit_r1(b, cap);
 }
 
-void repair_2bad_case3(Chunk *chunk, int i, UNUSED_PARAM int j) {
+static void emit_case3(Schedule *b, size_t *cap) {
     /* i < m && j == m + 1 */
-    assert(chunk != NULL);
-    assert(i < chunk->p);
-    int m = chunk->p;
+    int m = b->p, i = b->i;
+    int first = i == 0 ? 1 : 0;
     for (int k = 0; k < m - 1; ++k)
-        PZERO(AT(k, i));
-    for (int l = 0; l < i; ++l) {
-        for (int k = 0; k < m - 1; ++k) {
-            PXOR(AT(k, i), AT(k, l));
-        }
-    }
-    for (int l = i + 1; l <= m; ++l) {
-        for (int k = 0; k < m - 1; ++k) {
-            PXOR(AT(k, i), AT(k, l));
-        }
+        emit(b, cap, OP_COPY, C(k, i), C(k, first));
+    for (int l = first + 1; l <= m; ++l) {
+        if (l == i)
+            continue;
+        for (int k = 0; k < m - 1; ++k)
+            emit(b, cap, OP_XOR, C(k, i), C(k, l));
     }
-    cook_chunk_r2(chunk);
+    emit_r2(b, cap);
 }
 
-void repair_2bad_case4(Chunk *chunk, int i, int j) {
-    assert(chunk != NULL);
-    assert(i < chunk->p);
-    assert(j < chunk->p);
-    int m = chunk->p;
-    /* 损坏的是两块原始数据磁盘 */
-    Packet S;
-    PZERO(S);
-    for (int l = 0; l <= m - 2; ++l) {
-        PXOR(S, ATR(l, m));
-        PXOR(S, ATR(l, m + 1));
-    }
+static void emit_case4(Schedule *b, size_t *cap) {
+    /* i < m && j < m，损坏的是两块原始数据磁盘 */
+    int m = b->p, i = b->i, j = b->j;
+
+    /* S 为两个校验列所有单元的异或值 */
+    for (int l = 0; l <= m - 2; ++l)
+        emit(b, cap, l == 0 ? OP_COPY : OP_XOR, T(0), C(l, m));
+    for (int l = 0; l <= m - 2; ++l)
+        emit(b, cap, OP_XOR, T(0), C(l, m + 1));
+
     // horizontal syndromes S0
     // diagonal syndromes S1
-    Packet S0[PMAX];
-    Packet S1[PMAX];
+    unsigned int S0 = T(1);
+    unsigned int S1 = T(m);
 
-    for (int u = 0; u <= m - 1; ++u) {
-        PZERO(S0[u]);
-        PASGN(S1[u], S);
-        PXOR(S1[u], ATR(u, m + 1));
-    }
+    for (int u = 0; u <= m - 2; ++u)
+        emit(b, cap, OP_ZERO, S0 + u, 0);
+    for (int u = 0; u <= m - 1; ++u)
+        emit(b, cap, OP_COPY, S1 + u, T(0));
+    for (int u = 0; u <= m - 2; ++u)
+        emit(b, cap, OP_XOR, S1 + u, C(u, m + 1));
 
     for (int l = 0; l <= m; ++l) {
         if (l == i || l == j)
             continue;
-        for (int u = 0; u < m - 1; ++u)
-            PXOR(S0[u], AT(u, l));
+        for (int u = 0; u <= m - 2; ++u)
+            emit(b, cap, OP_XOR, S0 + u, C(u, l));
     }
 
-    if (i != 0 && j != 0) {
-        for (int u = 0; u < m - 1; ++u)
-            PXOR(S1[u], AT(u, 0));
-    }
-    for (int l = 1; l <= m - 1; ++l) {
+    for (int l = 0; l <= m - 1; ++l) {
         if (l == i || l == j)
             continue;
-        for (int u = 0; u < l - 1; ++u)
-            PXOR(S1[u], AT(m + u - l, l));
-        for (int u = l; u < m; ++u)
-            PXOR(S1[u], AT(u - l, l));
+        emit_shifted(b, cap, S1, m, l, M(-l));
     }
 
     int step = j - i;
     for (int s = m - 1 - step; s != m - 1; s -= step) {
-        AT(s, j) = S1[M(s + j)];
-        PXOR(AT(s, j), ATR(M(s + step), i));
-        AT(s, i) = S0[s];
-        PXOR(AT(s, i), AT(s, j));
+        emit(b, cap, OP_COPY, C(s, j), S1 + M(s + j));
+        if (M(s + step) != m - 1)
+            emit(b, cap, OP_XOR, C(s, j), C(M(s + step), i));
+        emit(b, cap, OP_COPY, C(s, i), S0 + s);
+        emit(b, cap, OP_XOR, C(s, i), C(s, j));
         s += m * (s < step);
     }
 }
 
+/**
+ * schedule_new() - 为 (p, i, j) 生成调度表
+ */
+static Schedule *schedule_new(int p, int i, int j) {
+    Schedule *s = calloc(1, sizeof(Schedule));
+    size_t cap = 0;
+    assert(s != NULL);
+    assert(i < j);
+    s->p = p;
+    s->i = i;
+    s->j = j;
+    if (i == p && j == p + 1) {
+        /* 损坏的是两个保存校验值的磁盘 */
+        emit_case1(s, &cap);
+    } else if (i < p && j == p) {
+        emit_case2(s, &cap);
+    } else if (i < p && j == p + 1) {
+        /* 损坏的是一块原始数据磁盘，和保存对角线校验值的磁盘 */
+        emit_case3(s, &cap);
+    } else { // i < p and j < p
+        emit_case4(s, &cap);
+    }
+    return s;
+}
+
+static Schedule *schedule_cache = NULL;
+static pthread_mutex_t schedule_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * schedule_get() - 获取 (p, i, j) 对应的调度表
+ *
+ * 生成的调度表会被缓存，进程退出前不会释放。可以在多个线程中同时调用。
+ */
+const Schedule *schedule_get(int p, int i, int j) {
+    Schedule *s;
+    pthread_mutex_lock(&schedule_lock);
+    for (s = schedule_cache; s != NULL; s = s->next) {
+        if (s->p == p && s->i == i && s->j == j)
+            break;
+    }
+    if (s == NULL) {
+        s = schedule_new(p, i, j);
+        s->next = schedule_cache;
+        schedule_cache = s;
+    }
+    pthread_mutex_unlock(&schedule_lock);
+    return s;
+}
+
+/**
+ * schedule_run() - 对 chunk 执行调度表，重新计算第 i 列和第 j 列
+ */
+void schedule_run(const Schedule *sched, Chunk *chunk) {
+    assert(chunk != NULL);
+    assert(sched->p == chunk->p);
+    size_t w = CHUNK_WIDTH(chunk);
+    for (size_t k = 0; k < sched->num; ++k) {
+        const XorOp *op = &sched->ops[k];
+        Packet *dst = CHUNK_CELL(chunk, op->dst);
+        const Packet *src = CHUNK_CELL(chunk, op->src);
+        switch (op->op) {
+        case OP_XOR:
+            PXORN(dst, src, op->len * w);
+            break;
+        case OP_COPY:
+            PASGNN(dst, src, op->len * w);
+            break;
+        case OP_ZERO:
+            PZERON(dst, op->len * w);
+            break;
+        default:
+            assert(0);
+        }
+    }
+}
@@ -1,14 +1,52 @@
 #ifndef REPAIR_H_
 #define REPAIR_H_
 
+#include <stddef.h>
 #include "chunk.h"
 #include "util.h"
 
-void cook_chunk_r1(Chunk *chunk);
-void cook_chunk_r2(Chunk *chunk);
-void repair_2bad_case1(Chunk *chunk, UNUSED_PARAM int i, UNUSED_PARAM int j);
-void repair_2bad_case2(Chunk *chunk, int i, UNUSED_PARAM int j);
-void repair_2bad_case3(Chunk *chunk, int i, UNUSED_PARAM int j);
-void repair_2bad_case4(Chunk *chunk, int i, int j);
+/**
+ * XorOp - 调度表中的一条运算
+ *
+ * @op - OP_XOR、OP_COPY 或 OP_ZERO
+ * @dst - 目标单元编号
+ * @src - 源单元编号，OP_ZERO 时无意义
+ * @len - 连续处理的单元数量
+ *
+ * 单元编号即单元在 chunk->data 中的下标：第 col 列第 row 行的单元编号为
+ * col * (p-1) + row，临时单元紧随矩阵之后，编号从 (p+2) * (p-1) 开始。
+ */
+typedef struct {
+    int op;
+    unsigned int dst;
+    unsigned int src;
+    unsigned int len;
+} XorOp;
+
+enum { OP_XOR, OP_COPY, OP_ZERO };
+
+/**
+ * Schedule - 对某个 p 和某种损坏情况预先编译好的运算序列
+ *
+ * @p - 所使用的质数
+ * @i @j - 需要重新计算的两列，i < j
+ * @num - ops 的长度
+ * @ops - 运算序列，按顺序执行即可算出第 i 列和第 j 列
+ * @next - 缓存链表
+ *
+ * 哪些单元参与运算、运算的先后顺序只与 (p, i, j) 有关，与 chunk 中的数据无关。
+ * 所以对每种情况只需生成一次调度表，之后对文件中所有的 chunk 都按表执行，省去
+ * 取模、跳过全零行等下标计算。
+ */
+typedef struct Schedule {
+    int p;
+    int i, j;
+    size_t num;
+    XorOp *ops;
+    struct Schedule *next;
+} Schedule;
+
+const Schedule *schedule_get(int p, int i, int j);
+void schedule_run(const Schedule *sched, Chunk *chunk);
 
 #endif
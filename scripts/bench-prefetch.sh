@@ -0,0 +1,52 @@
+#!/bin/bash
+
+set -e
+
+exec 2>&1
+
+cd "$(dirname "$0")/.." || exit 1
+sh compile.sh
+mkdir -p test
+cd test || exit 1
+
+# 比较有无预读时，损坏一个磁盘后读取和修复的耗时。以 root 运行时每次先清空页
+# 缓存，模拟数据都在磁盘上的情况。
+filesize=$((1024 * 1024 * ${SIZE_MB:-256}))
+runs=${RUNS:-5}
+
+if ! [ -r test.bin ] || [ "$(stat -c '%s' test.bin)" -ne "$filesize" ]; then
+    head -c "$filesize" /dev/urandom > test.bin
+fi
+
+drop_caches() {
+    sync
+    if [ -w /proc/sys/vm/drop_caches ]; then
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+}
+
+# 每次先删除 disk_1，运行 runs 次，输出耗时的中位数（毫秒）
+median() {
+    for _ in $(seq "$runs"); do
+        rm -rf disk_1
+        drop_caches
+        begin=$(date +%s%N)
+        EVENODD_PREFETCH="$prefetch" "$@" > /dev/null
+        end=$(date +%s%N)
+        echo $(((end - begin) / 1000000))
+    done | sort -n | sed -n "$(((runs + 1) / 2))p"
+}
+
+for p in 31 101; do
+    rm -rf disk_* save
+    ../evenodd write test.bin "$p"
+    mkdir save
+    cp disk_1/test.bin save/
+    for prefetch in 0 $((64 * 1024 * 1024)); do
+        read_ms=$(median ../evenodd read test.bin test.bin.rtv)
+        cmp test.bin test.bin.rtv
+        repair_ms=$(median ../evenodd repair 1 1)
+        cmp save/test.bin disk_1/test.bin
+        echo "p=$p prefetch=$prefetch read ${read_ms}ms repair ${repair_ms}ms"
+    done
+done
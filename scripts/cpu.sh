@@ -2,7 +2,7 @@
 
 set -e
 cd "$(dirname "$0")/.."
-gcc -O2 -DPERFCNT -DNDEBUG -pthread -std=gnu11 -o evenodd mmio/mmio.c spsc/spsc.c evenodd.c -Wall -Wextra -Wshadow
+gcc -O2 -DPERFCNT -DNDEBUG -pthread -std=gnu11 -o evenodd mmio/mmio.c spsc/spsc.c evenodd.c chunk.c metadata.c repair.c simd.c kernel.c diskio.c prefetch.c range.c pack.c catalog.c -Wall -Wextra -Wshadow
 cd test
 # dd if=/dev/urandom of=test3.bin bs=1024M count=2 iflag=fullblock
 for i in 3 5 7 11 13 17 19 23 29 31 37 41 43 47; do
@@ -0,0 +1,43 @@
+#!/bin/bash
+
+set -e
+
+cd "$(dirname "$0")/.." || exit 1
+sh compile.sh
+rm -rf test
+mkdir -p test/src/a/b test/one test/many
+cd test || exit 1
+
+for i in $(seq 1 200); do
+    head -c $((RANDOM * (RANDOM % 4) + RANDOM % 50)) /dev/urandom > "src/a/f$i"
+done
+: > src/empty
+head -c 9000001 /dev/urandom > src/a/b/big
+find src -type f > list
+ln -s ../src one/src
+ln -s ../src many/src
+
+# 批量写入的磁盘文件应与逐个写入的结果完全一致，批量读取应得到原始文件
+for p in 3 5 13; do
+    echo p is "$p"
+    rm -rf one/disk_* many/disk_*
+    (cd one && while read -r line; do ../../evenodd write "$line" "$p"; done < ../list)
+    (cd many && ../../evenodd write src "$p")
+    diff -r -x .evenodd-catalog one many
+
+    cd many
+    for bad in "" "$((RANDOM % (p + 2)))" "0 $((p + 1))"; do
+        rm -rf disk_* out
+        cp -r ../one/disk_* .
+        for disk in $bad; do
+            rm -rf "disk_$disk"
+        done
+        ../../evenodd read @../list out
+        diff -r src/ out/src/ || exit 2
+        rm -rf out
+        ../../evenodd read src out
+        diff -r src/ out/src/ || exit 2
+    done
+    rm -rf out
+    cd ..
+done
@@ -0,0 +1,100 @@
+#!/bin/bash
+
+set -e
+
+cd "$(dirname "$0")/.." || exit 1
+sh compile.sh
+rm -rf test
+mkdir -p test/src/a test/src/b
+cd test || exit 1
+
+# 旧版本中 "src/aBb" 与 "src/a/b" 使用同一个磁盘文件名
+head -c 1000 /dev/urandom > src/a/b
+head -c 2000 /dev/urandom > src/aBb
+head -c 3000 /dev/urandom > src/100%
+for i in $(seq 1 50); do
+    head -c $((RANDOM % 5000)) /dev/urandom > "src/b/f$i"
+done
+find src -type f | sort > list
+
+for p in 3 5 13; do
+    echo p is "$p"
+    rm -rf disk_* good
+
+    ../evenodd write src/a/b "$p"
+    ../evenodd write src/aBb 3
+    ../evenodd write src/100% "$p"
+    ../evenodd write src/b "$p"
+    for f in src/a/b src/aBb src/100%; do
+        ../evenodd read "$f" out
+        cmp "$f" out || exit 2
+    done
+
+    # list 列出所有文件；src/aBb 使用 p=3，不占用磁盘 5 及之后的磁盘
+    ../evenodd list | cut -f 1 | sort | diff list -
+    ../evenodd list 5 | grep -q "^src/aBb" && exit 2
+    ../evenodd list 4 | grep -q "^src/aBb"
+
+    mkdir good
+    cp -r disk_* good/
+    for bad in "0" "0 1" "2 $((p + 1))"; do
+        rm -rf disk_*
+        cp -r good/disk_* .
+        for disk in $bad; do
+            rm -rf "disk_$disk"
+        done
+        set -- $bad
+        ../evenodd repair $# "$@"
+        for disk in $bad; do
+            diff -r "good/disk_$disk" "disk_$disk" || exit 2
+        done
+    done
+
+    # 写了一半的记录被跳过，其后的记录仍然有效
+    printf 'CTLG torn' >> disk_1/.evenodd-catalog
+    head -c 10 /dev/urandom > src/b/f1
+    ../evenodd write src/b/f1 "$p"
+    ../evenodd list | grep -q "^src/b/f1	10$"
+
+    # 同时写入的多个进程追加的记录在各份目录中顺序相同；较短的一份只补上缺少的部分
+    for i in 1 2 3 4; do
+        ../evenodd write src/b "$p" > /dev/null &
+    done
+    wait
+    cmp disk_0/.evenodd-catalog disk_1/.evenodd-catalog || exit 2
+    cmp disk_0/.evenodd-catalog disk_2/.evenodd-catalog || exit 2
+    truncate -s -100 disk_2/.evenodd-catalog
+    ../evenodd write src/b/f1 "$p"
+    cmp disk_0/.evenodd-catalog disk_2/.evenodd-catalog || exit 2
+
+    # 旧版本的磁盘文件名，没有目录
+    rm -rf disk_*
+    cp -r good/disk_* .
+    rm disk_[012]/.evenodd-catalog
+    for disk in disk_*; do
+        mv "$disk/src%2Fb%2Ff2" "$disk/srcDbFf2"
+    done
+    ../evenodd read src/b/f2 out
+    cmp src/b/f2 out || exit 2
+    ../evenodd list | grep -q "^srcDbFf2"
+    rm -rf out
+done
+
+# 反复重写同一批文件，目录被压缩，长度取决于现有的文件而不是写入的次数
+rm -rf disk_* out
+for i in $(seq 1 60); do
+    ../evenodd write src/b 5 > /dev/null
+done
+[ "$(stat -c %s disk_0/.evenodd-catalog)" -lt 100000 ] || exit 2
+cmp disk_0/.evenodd-catalog disk_1/.evenodd-catalog || exit 2
+cmp disk_0/.evenodd-catalog disk_2/.evenodd-catalog || exit 2
+[ "$(../evenodd list | wc -l)" -eq 50 ] || exit 2
+../evenodd read src/b out
+diff -r src/b out/src/b || exit 2
+
+# 压缩到一半时中断，代数较小的一份被整个替换
+tail -c +17 disk_0/.evenodd-catalog > old
+cat old old > disk_2/.evenodd-catalog
+../evenodd write src/b/f1 5
+cmp disk_0/.evenodd-catalog disk_2/.evenodd-catalog || exit 2
+rm -rf out old
@@ -0,0 +1,83 @@
+#!/bin/bash
+
+set -e
+
+cd "$(dirname "$0")/.." || exit 1
+sh compile.sh
+rm -rf test
+mkdir -p test/src/a/b
+cd test || exit 1
+
+for i in $(seq 1 300); do
+    head -c $((RANDOM * (RANDOM % 4) + RANDOM % 50)) /dev/urandom > "src/a/f$i"
+done
+: > src/empty
+head -c 3000001 /dev/urandom > src/a/b/big
+find src -type f > list
+
+for p in 3 5 13; do
+    echo p is "$p"
+    rm -rf disk_* good
+    ../evenodd pack src "$p"
+
+    # 后打包的容器段和单独写入的文件覆盖之前打包的同名文件
+    cp src/a/f1 f1.old
+    head -c 777 /dev/urandom > src/a/f1
+    echo src/a/f1 | ../evenodd pack @- "$p"
+    head -c 555 /dev/urandom > src/a/f2
+    ../evenodd write src/a/f2 "$p"
+    # 之后打包的新内容也覆盖之前单独写入的文件
+    head -c 999 /dev/urandom > src/a/f3
+    ../evenodd write src/a/f3 "$p"
+    head -c 1234 /dev/urandom > src/a/f3
+    echo src/a/f3 | ../evenodd pack @- "$p"
+    ../evenodd list | grep -qx "src/a/f3	1234" || exit 2
+    mkdir good
+    cp -r disk_* good/
+
+    for bad in "" "$((RANDOM % (p + 2)))" "0 $((p + 1))" "1 2"; do
+        rm -rf disk_* out
+        cp -r good/disk_* .
+        for disk in $bad; do
+            rm -rf "disk_$disk"
+        done
+        ../evenodd read @list out
+        diff -r src/ out/src/ || exit 2
+        rm -rf out
+        ../evenodd read src out
+        diff -r src/ out/src/ || exit 2
+        for f in src/a/f1 src/a/f2 src/a/f3 src/empty src/a/b/big; do
+            ../evenodd read "$f" one
+            cmp "$f" one || exit 2
+            ../evenodd read "$f" - --offset 7 --length 100 > one
+            cmp <(tail -c +8 "$f" | head -c 100) one || exit 2
+        done
+
+        set -- $bad
+        if [ $# -ne 0 ]; then
+            ../evenodd repair $# "$@"
+            for disk in $bad; do
+                diff -r "good/disk_$disk" "disk_$disk" || exit 2
+            done
+        fi
+    done
+    cp f1.old src/a/f1
+    rm -rf out one
+done
+
+# 同时打包的多个进程各自占用不同的容器段
+rm -rf disk_* out
+for i in 1 2 3 4; do
+    mkdir -p "c$i"
+    for j in $(seq 1 50); do
+        head -c $((RANDOM % 3000)) /dev/urandom > "c$i/f$j"
+    done
+done
+for i in 1 2 3 4; do
+    ../evenodd pack "c$i" 5 &
+done
+wait
+for i in 1 2 3 4; do
+    ../evenodd read "c$i" out
+    diff -r "c$i" "out/c$i" || exit 2
+done
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+set -e
+
+cd "$(dirname "$0")/.." || exit 1
+sh compile.sh
+mkdir -p test
+cd test || exit 1
+
+# 比较 read --offset --length 的结果与原始文件中的同一段
+check_range() {
+    offset="$1"
+    length="$2"
+    ../evenodd read test.bin test.bin.rtv --offset "$offset" --length "$length"
+    tail -c +"$((offset + 1))" test.bin | head -c "$length" > test.bin.expect
+    cmp test.bin.expect test.bin.rtv || exit 2
+}
+
+for filesize in 1 9981 1000000 3000001; do
+    echo filesize is "$filesize"
+    dd status=none if=/dev/urandom of=test.bin bs="$filesize" count=1 iflag=fullblock
+
+    for p in 3 5 13 101; do
+        echo p is "$p"
+        rm -rf disk*
+        ../evenodd write test.bin "$p"
+
+        for bad in "" "$((RANDOM % p))" "$p $((p + 1))" "0 $((RANDOM % (p - 1) + 1))"; do
+            for disk in $bad; do
+                rm -rf "disk_$disk"
+            done
+            check_range 0 "$filesize"
+            check_range 0 1
+            check_range "$((filesize / 3))" "$((filesize / 2 + 1))"
+            check_range "$((filesize - 1))" 100
+            check_range "$((RANDOM * 37 % filesize))" "$((RANDOM % 70000))"
+            check_range "$filesize" 10
+            ../evenodd write test.bin "$p"
+        done
+    done
+done
@@ -0,0 +1,39 @@
+#!/bin/bash
+
+set -e
+
+cd "$(dirname "$0")/.." || exit 1
+sh compile.sh
+rm -rf test
+mkdir -p test
+cd test || exit 1
+
+# 大量不同 p 的小文件与被切成多段的大文件一起修复，重建的磁盘应与原来完全一致
+ps=(3 5 7 13)
+for i in $(seq 1 200); do
+    head -c $((RANDOM * (RANDOM % 8) + RANDOM % 100)) /dev/urandom > "f$i.bin"
+    ../evenodd write "f$i.bin" "${ps[$((i % 4))]}"
+    rm "f$i.bin"
+done
+for filesize in 70000000 140000001; do
+    head -c "$filesize" /dev/urandom > "big$filesize.bin"
+    ../evenodd write "big$filesize.bin" 5
+    rm "big$filesize.bin"
+done
+mkdir ref
+cp -r disk_* ref/
+
+for streams in 1 3 16; do
+    echo streams is "$streams"
+    for bad in "1" "0 2" "5 7" "6 14"; do
+        set -- $bad
+        for disk in $bad; do
+            rm -rf "disk_$disk"
+        done
+        EVENODD_REPAIR_STREAMS="$streams" ../evenodd repair $# $bad
+        for disk in $bad; do
+            diff -r "ref/disk_$disk" "disk_$disk" || exit 2
+        done
+    done
+done
+rm -rf ref
@@ -0,0 +1,50 @@
+#!/bin/bash
+
+set -e
+
+cd "$(dirname "$0")/.." || exit 1
+sh compile.sh
+rm -rf test
+mkdir -p test/src
+cd test || exit 1
+
+for i in $(seq 1 40); do
+    head -c $((RANDOM * (RANDOM % 3) + RANDOM % 50)) /dev/urandom > "src/f$i"
+done
+head -c 5000001 /dev/urandom > src/big
+find src -type f > list
+
+# 轮转的位数记录在磁盘文件开头 Metadata 的第 40 个字节处
+rotations() {
+    for f in disk_0/*; do
+        od -An -tu4 -j40 -N4 "$f"
+    done | sort -u | wc -l
+}
+
+for p in 3 5 7; do
+    echo p is "$p"
+    rm -rf disk_* good
+    ../evenodd write src "$p"
+    EVENODD_ROTATE=0 ../evenodd write src/big "$p"
+    [ "$(rotations)" -gt 2 ] || exit 2
+
+    mkdir good
+    cp -r disk_* good/
+    for a in $(seq 0 $((p + 1))); do
+        for b in $(seq "$a" $((p + 1))); do
+            rm -rf disk_* out
+            cp -r good/disk_* .
+            rm -rf "disk_$a" "disk_$b"
+            ../evenodd read @list out
+            diff -r src/ out/src/ || exit 2
+            ../evenodd read src/f1 - --offset 5 --length 1000 | cmp - <(tail -c +6 src/f1 | head -c 1000)
+            if [ "$a" = "$b" ]; then
+                ../evenodd repair 1 "$a"
+            else
+                ../evenodd repair 2 "$a" "$b"
+            fi
+            diff -r good/ . -x good -x out -x src -x list || exit 2
+        done
+    done
+    rm -rf out
+done
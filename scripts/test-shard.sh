@@ -0,0 +1,43 @@
+#!/bin/bash
+
+set -e
+
+cd "$(dirname "$0")/.." || exit 1
+sh compile.sh
+mkdir -p test/whole test/shard
+cd test || exit 1
+
+# 分片写入的磁盘文件应与不分片的结果完全一致，分片读取应得到原始文件
+for filesize in 1 9981 5000000 12345677; do
+    echo filesize is "$filesize"
+    head -c "$filesize" /dev/urandom > test.bin
+
+    for p in 3 5 13; do
+        for cell in 8 64 4096; do
+            echo p is "$p", cell is "$cell"
+            (cd whole && rm -rf disk* && cp ../test.bin . && EVENODD_SHARDS=1 ../../evenodd write test.bin "$p" "$cell")
+            (cd shard && rm -rf disk* && cp ../test.bin . && EVENODD_SHARDS=5 ../../evenodd write test.bin "$p" "$cell")
+            for disk in $(seq 0 $((p + 1))); do
+                cmp "whole/disk_$disk/test.bin" "shard/disk_$disk/test.bin" || exit 2
+            done
+
+            cd shard
+            for bad in "" "$((RANDOM % (p + 2)))" "0 $((p + 1))"; do
+                rm -rf disk* && cp -r ../whole/disk* .
+                for disk in $bad; do
+                    rm -rf "disk_$disk"
+                done
+                EVENODD_SHARDS=5 ../../evenodd read test.bin test.bin.rtv
+                cmp ../test.bin test.bin.rtv || exit 2
+            done
+
+            # 三个磁盘损坏时以非零状态退出，不留下输出文件
+            rm -rf test.bin.rtv disk_0 disk_1 disk_2
+            if EVENODD_SHARDS=5 ../../evenodd read test.bin test.bin.rtv; then
+                exit 2
+            fi
+            [ ! -e test.bin.rtv ] || exit 2
+            cd ..
+        done
+    done
+done
@@ -0,0 +1,32 @@
+#!/bin/bash
+
+set -e
+
+cd "$(dirname "$0")/.." || exit 1
+sh compile.sh
+mkdir -p test/file test/stream
+cd test || exit 1
+
+# 从管道写入的磁盘文件应与直接写入同一文件（相同单元大小）的结果完全一致
+for filesize in 0 1 9981 1000000 3000001; do
+    echo filesize is "$filesize"
+    head -c "$filesize" /dev/urandom > test.bin
+
+    for p in 3 5 13 101; do
+        echo p is "$p"
+        (cd file && rm -rf disk* && cp ../test.bin . && ../../evenodd write test.bin "$p" 4096)
+        (cd stream && rm -rf disk* && cat ../test.bin | ../../evenodd write test.bin "$p" --stdin)
+        for disk in $(seq 0 $((p + 1))); do
+            cmp "file/disk_$disk/test.bin" "stream/disk_$disk/test.bin" || exit 2
+        done
+
+        # 读到标准输出，先在磁盘都完好时，再在损坏一个磁盘时
+        cd stream
+        ../../evenodd read test.bin - | cmp ../test.bin - || exit 2
+        rm -rf "disk_$((RANDOM % (p + 2)))"
+        ../../evenodd read test.bin test.bin.rtv
+        cmp ../test.bin test.bin.rtv || exit 2
+        ../../evenodd read test.bin - | cmp ../test.bin - || exit 2
+        cd ..
+    done
+done
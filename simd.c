@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packet.h"
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define SIMD_NEON
+#endif
+
+static void xor_scalar(Packet *dst, const Packet *src, size_t n) {
+    for (size_t k = 0; k < n; ++k)
+        PXOR(dst[k], src[k]);
+}
+
+#ifdef SIMD_X86
+__attribute__((target("sse2")))
+static void xor_sse2(Packet *dst, const Packet *src, size_t n) {
+    size_t k = 0;
+    for (; k + 2 <= n; k += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + k));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + k));
+        _mm_storeu_si128((__m128i *)(dst + k), _mm_xor_si128(a, b));
+    }
+    for (; k < n; ++k)
+        PXOR(dst[k], src[k]);
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(Packet *dst, const Packet *src, size_t n) {
+    size_t k = 0;
+    for (; k + 8 <= n; k += 8) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(dst + k));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(dst + k + 4));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(src + k));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(src + k + 4));
+        _mm256_storeu_si256((__m256i *)(dst + k), _mm256_xor_si256(a0, b0));
+        _mm256_storeu_si256((__m256i *)(dst + k + 4), _mm256_xor_si256(a1, b1));
+    }
+    for (; k + 4 <= n; k += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + k));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + k));
+        _mm256_storeu_si256((__m256i *)(dst + k), _mm256_xor_si256(a, b));
+    }
+    for (; k < n; ++k)
+        PXOR(dst[k], src[k]);
+}
+
+__attribute__((target("avx512f")))
+static void xor_avx512(Packet *dst, const Packet *src, size_t n) {
+    size_t k = 0;
+    for (; k + 8 <= n; k += 8) {
+        __m512i a = _mm512_loadu_si512((const void *)(dst + k));
+        __m512i b = _mm512_loadu_si512((const void *)(src + k));
+        _mm512_storeu_si512((void *)(dst + k), _mm512_xor_si512(a, b));
+    }
+    if (k < n) {
+        /* 尾部不足 8 个 Packet 时使用掩码读写，避免越界 */
+        __mmask8 mask = (__mmask8)((1u << (n - k)) - 1);
+        __m512i a = _mm512_maskz_loadu_epi64(mask, dst + k);
+        __m512i b = _mm512_maskz_loadu_epi64(mask, src + k);
+        _mm512_mask_storeu_epi64(dst + k, mask, _mm512_xor_si512(a, b));
+    }
+}
+#endif
+
+#ifdef SIMD_NEON
+static void xor_neon(Packet *dst, const Packet *src, size_t n) {
+    size_t k = 0;
+    for (; k + 4 <= n; k += 4) {
+        uint64x2_t a0 = vld1q_u64(dst + k);
+        uint64x2_t a1 = vld1q_u64(dst + k + 2);
+        uint64x2_t b0 = vld1q_u64(src + k);
+        uint64x2_t b1 = vld1q_u64(src + k + 2);
+        vst1q_u64(dst + k, veorq_u64(a0, b0));
+        vst1q_u64(dst + k + 2, veorq_u64(a1, b1));
+    }
+    for (; k < n; ++k)
+        PXOR(dst[k], src[k]);
+}
+#endif
+
+/**
+ * simd_kernels - 所有可用的内核，按优先级从高到低排列
+ *
+ * 标量实现放在最后，保证总能选出一个内核。
+ */
+static const PacketOps simd_kernels[] = {
+#ifdef SIMD_X86
+    { "avx512", xor_avx512 },
+    { "avx2", xor_avx2 },
+    { "sse2", xor_sse2 },
+#endif
+#ifdef SIMD_NEON
+    { "neon", xor_neon },
+#endif
+    { "scalar", xor_scalar },
+};
+
+/**
+ * simd - 当前所使用的内核
+ *
+ * 在 simd_init() 调用之前为标量实现，所以忘记初始化只会变慢，不会出错。
+ */
+PacketOps simd = { "scalar", xor_scalar };
+
+static int simd_supported(const char *name) {
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "avx512") == 0)
+        return __builtin_cpu_supports("avx512f");
+    if (strcmp(name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+#endif
+#ifdef SIMD_NEON
+    if (strcmp(name, "neon") == 0)
+        return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#endif
+    return strcmp(name, "scalar") == 0;
+}
+
+/**
+ * simd_init() - 根据 cpuid/hwcap 选择最快的内核
+ *
+ * 设置环境变量 EVENODD_SIMD 为内核名称（如 scalar）时强制使用该内核，用于测试
+ * 各实现的输出是否一致。所指定的内核不被支持时，退回自动选择。设置了该变量时
+ * 在标准错误输出实际选中的内核，测试据此发现被跳过的内核。
+ */
+void simd_init(void) {
+    size_t num = sizeof(simd_kernels) / sizeof(simd_kernels[0]);
+    const char *force = getenv("EVENODD_SIMD");
+
+    if (force != NULL) {
+        for (size_t k = 0; k < num; ++k) {
+            if (strcmp(simd_kernels[k].name, force) == 0
+                    && simd_supported(force)) {
+                simd = simd_kernels[k];
+                fprintf(stderr, "simd: %s\n", simd.name);
+                return;
+            }
+        }
+        fprintf(stderr, "EVENODD_SIMD=%s not supported, ignored\n", force);
+    }
+
+    for (size_t k = 0; k < num; ++k) {
+        if (simd_supported(simd_kernels[k].name)) {
+            simd = simd_kernels[k];
+            break;
+        }
+    }
+    if (force != NULL)
+        fprintf(stderr, "simd: %s\n", simd.name);
+}
@@ -0,0 +1,49 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <stddef.h>
+#include <string.h>
+#include "packet.h"
+
+/**
+ * PacketOps - 对一段连续 Packet 进行运算的内核
+ *
+ * @name - 内核名称，用于调试输出及通过环境变量 EVENODD_SIMD 强制选择
+ * @xor - dst[k] ^= src[k]，k 取 [0, n)。dst 与 src 不得部分重叠
+ *
+ * 校验与恢复中的运算几乎全部是“将某列的连续若干个 Packet 异或到另一列的连续
+ * 若干个 Packet 上”，所以只需要对这一种运算提供各种指令集的实现即可。
+ *
+ * 各实现的输出与标量实现逐位一致。
+ */
+typedef struct {
+    const char *name;
+    void (*xor)(Packet *dst, const Packet *src, size_t n);
+} PacketOps;
+
+extern PacketOps simd;
+
+void simd_init(void);
+
+/**
+ * PXORN() - 将 src 开始的 n 个 Packet 异或到 dst 开始的 n 个 Packet 上
+ */
+#define PXORN(dst, src, n) do { \
+    simd.xor((dst), (src), (n)); \
+} while (0)
+
+/**
+ * PASGNN() - 将 src 开始的 n 个 Packet 复制到 dst 开始的 n 个 Packet 上
+ */
+#define PASGNN(dst, src, n) do { \
+    memcpy((dst), (src), sizeof(Packet) * (n)); \
+} while (0)
+
+/**
+ * PZERON() - 将 dst 开始的 n 个 Packet 置零
+ */
+#define PZERON(dst, n) do { \
+    memset((dst), 0, sizeof(Packet) * (n)); \
+} while (0)
+
+#endif
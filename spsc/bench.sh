@@ -0,0 +1,7 @@
+#!/bin/bash
+cd "$(dirname "$0")" || exit 1
+gcc -Wall -Wshadow -O2 test.c spsc.c -pthread -o bench
+./bench bench
+ret=$?
+rm bench
+exit $ret
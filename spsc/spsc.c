@@ -1,5 +1,16 @@
 #include "spsc.h"
 #include <stdio.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/**
+ * SPSC_SPIN_LIMIT - 自适应等待时，开始让出 CPU 前空转的次数
+ * SPSC_YIELD_LIMIT - 自适应等待时，开始睡眠前让出 CPU 的次数
+ */
+#define SPSC_SPIN_LIMIT (1024)
+#define SPSC_YIELD_LIMIT (64)
 
 static unsigned int roundup_pow_two(unsigned int size) {
     while (size - (size & (-size)) != 0) {
@@ -10,79 +21,132 @@ static unsigned int roundup_pow_two(unsigned int size) {
 
 SpscQueue SpscQueue_new(unsigned int size) {
     return (SpscQueue) {
-#ifdef PERFCNT
-        .push = {
-            .wait = 0,
-            .cnt = 0,
-        },
-        .pop = {
-            .wait = 0,
-            .cnt = 0,
-        },
-#endif
         .data = malloc(sizeof(ItemType) * roundup_pow_two(size)),
-        .in = 0,
-        .out = 0,
-        .mask = roundup_pow_two(size) - 1
+        .mask = roundup_pow_two(size) - 1,
+        .wait = SPSC_WAIT_ADAPTIVE,
     };
 }
 
+/**
+ * wait_change() - 等待 *word 不再等于 val，返回新的值
+ *
+ * @parked - 睡眠前置为 1，醒来后置为 0，供对方判断是否需要唤醒
+ *
+ * 先置 parked 再检查 *word，对方则先修改 *word 再检查 parked，两方在中间都有一
+ * 个完整的内存屏障，所以要么本方看到新的 *word 而不睡眠，要么对方看到 parked
+ * 而唤醒。FUTEX_WAIT 本身也会在 *word 已经改变时立即返回。
+ */
+static unsigned int wait_change(SpscQueue *self, unsigned int *word, unsigned int val,
+        int *parked) {
+    unsigned int now;
+    for (unsigned int k = 0; (now = __atomic_load_n(word, __ATOMIC_ACQUIRE)) == val; ++k) {
+        if (self->wait == SPSC_WAIT_SPIN || k < SPSC_SPIN_LIMIT) {
+            cpu_relax();
+        } else if (k < SPSC_SPIN_LIMIT + SPSC_YIELD_LIMIT) {
+            sched_yield();
+        } else {
+            __atomic_store_n(parked, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(word, __ATOMIC_RELAXED) == val)
+                syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+            __atomic_store_n(parked, 0, __ATOMIC_RELAXED);
+        }
+    }
+    return now;
+}
+
+/**
+ * publish() - 将 *word 改为 val，并在对方睡眠时唤醒对方
+ *
+ * 元素的读写在此之前完成，release 保证对方 acquire 到新的 val 后能看到它们。
+ * 只有自适应等待时对方才会睡眠，才需要用屏障与 wait_change() 配对。
+ */
+static void publish(SpscQueue *self, unsigned int *word, unsigned int val, int *parked) {
+    __atomic_store_n(word, val, __ATOMIC_RELEASE);
+    if (self->wait == SPSC_WAIT_SPIN)
+        return;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(parked, __ATOMIC_RELAXED))
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 void SpscQueue_drop(SpscQueue *self) {
     free(self->data);
     *self = (SpscQueue) {
-#ifdef PERFCNT
-        .push = {
-            .wait = 0,
-            .cnt = 0,
-        },
-        .pop = {
-            .wait = 0,
-            .cnt = 0,
-        },
-#endif
         .data = NULL,
-        .in = 0,
-        .out = 0,
-        .mask = 0
+        .mask = 0,
+        .wait = SPSC_WAIT_ADAPTIVE,
     };
 }
 
-void SpscQueue_push(SpscQueue *self, ItemType data) {
+/**
+ * SpscQueue_push_n() - 依次放入 items 中的 n 个元素
+ *
+ * 队列已满时等待。空间足够时一次放入全部元素，对方只需要同步一次；空间不足时
+ * 每次放入当前能放下的部分。
+ */
+void SpscQueue_push_n(SpscQueue *self, const ItemType *items, unsigned int n) {
+    unsigned int in = self->in;
 #ifdef PERFCNT
-    // FIXME: barrier: magic
-    write_barrier();
-    if (SpscQueue_full(self)) {
+    if (in - __atomic_load_n(&self->out, __ATOMIC_RELAXED) + n > self->mask + 1) {
         self->push.wait += 1;
     }
     self->push.cnt += 1;
-    write_barrier();
 #endif
 
-    while (SpscQueue_full(self))
-        ;
-    unsigned int off = self->in & self->mask;
-    self->data[off] = data;
-    write_barrier();
-    self->in++;
+    while (n != 0) {
+        unsigned int space = self->mask + 1 - (in - self->out_cache);
+        if (space == 0) {
+            self->out_cache = __atomic_load_n(&self->out, __ATOMIC_ACQUIRE);
+            if (in - self->out_cache == self->mask + 1)
+                self->out_cache = wait_change(self, &self->out, self->out_cache,
+                        &self->push_parked);
+            continue;
+        }
+        unsigned int k = space < n ? space : n;
+        for (unsigned int t = 0; t < k; ++t)
+            self->data[(in + t) & self->mask] = items[t];
+        items += k;
+        n -= k;
+        in += k;
+        publish(self, &self->in, in, &self->pop_parked);
+    }
 }
 
-ItemType SpscQueue_pop(SpscQueue *self) {
+/**
+ * SpscQueue_pop_n() - 取出至多 n 个元素放在 items 中，返回取出的数量
+ *
+ * 队列为空时等待，直到至少能取出一个元素。不会为了凑够 n 个而等待。
+ */
+unsigned int SpscQueue_pop_n(SpscQueue *self, ItemType *items, unsigned int n) {
+    unsigned int out = self->out;
 #ifdef PERFCNT
-    // FIXME: barrier: magic
-    write_barrier();
-    if (SpscQueue_empty(self)) {
+    if (__atomic_load_n(&self->in, __ATOMIC_RELAXED) == out) {
         self->pop.wait += 1;
     }
     self->pop.cnt += 1;
-    write_barrier();
 #endif
 
-    while (SpscQueue_empty(self))
-        ;
-    unsigned int off = self->out & self->mask;
-    ItemType res = self->data[off];
-    read_barrier();
-    self->out++;
+    if (self->in_cache == out) {
+        self->in_cache = __atomic_load_n(&self->in, __ATOMIC_ACQUIRE);
+        if (self->in_cache == out)
+            self->in_cache = wait_change(self, &self->in, out, &self->pop_parked);
+    }
+    unsigned int avail = self->in_cache - out;
+    unsigned int k = avail < n ? avail : n;
+    for (unsigned int t = 0; t < k; ++t)
+        items[t] = self->data[(out + t) & self->mask];
+    publish(self, &self->out, out + k, &self->push_parked);
+    return k;
+}
+
+void SpscQueue_push(SpscQueue *self, ItemType data) {
+    SpscQueue_push_n(self, &data, 1);
+}
+
+ItemType SpscQueue_pop(SpscQueue *self) {
+    ItemType res;
+    SpscQueue_pop_n(self, &res, 1);
     return res;
 }
 
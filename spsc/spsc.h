@@ -1,31 +1,86 @@
+#ifndef SPSC_H_
+#define SPSC_H_
+
 #include <stdlib.h>
 
-#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
-#define read_barrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
-#define write_barrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
-#else // Non-GCC or old GCC.
-#if defined(__x86_64__) || defined(_M_X64_) || defined(_M_I86) || defined(__i386__)
-#define read_barrier()  __asm__ volatile("":::"memory")
-#define write_barrier() __asm__ volatile("":::"memory")
+/**
+ * SPSC_CACHELINE - 生产者和消费者各自修改的字段之间至少间隔的字节数
+ *
+ * 取 128 而不是 64：x86 会成对预取相邻的两个缓存行，部分 ARM 处理器的缓存行
+ * 本身就是 128 字节。
+ */
+#define SPSC_CACHELINE (128)
+
+typedef void *ItemType;
+
+/**
+ * cpu_relax() - 空转等待时提示处理器降低功耗、让出流水线给同核的其他线程
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
 #elif defined(__arm__) || defined(__aarch64__)
-#define read_barrier() __asm__ volatile("dmb sy")
-#define write_barrier() __asm__ volatile("dmb sy")
-#endif
+#define cpu_relax() __asm__ volatile("yield" ::: "memory")
+#else
+#define cpu_relax() do { } while (0)
 #endif
 
-typedef void *ItemType;
+/**
+ * 队列为空或已满时的等待策略
+ *
+ * SPSC_WAIT_SPIN - 一直空转，延迟最低，但对方在做 I/O 时会白白占满一个核
+ * SPSC_WAIT_ADAPTIVE - 先空转一小会，再让出 CPU 若干次，最后在 futex 上睡眠，
+ *                      直到对方唤醒。只有当对方确实在睡眠时才发起唤醒的系统调用
+ */
+enum { SPSC_WAIT_ADAPTIVE, SPSC_WAIT_SPIN };
 
+/**
+ * SpscQueue - 单生产者单消费者的环形队列
+ *
+ * @data @mask @wait - 创建后不再修改，两方都只读
+ * @in - 已经放入的元素数量，只由生产者修改
+ * @out_cache - 生产者上次看到的 out，只由生产者读写
+ * @pop_parked - 消费者是否在睡眠，由生产者在每次放入后检查
+ * @out - 已经取出的元素数量，只由消费者修改
+ * @in_cache - 消费者上次看到的 in，只由消费者读写
+ * @push_parked - 生产者是否在睡眠，由消费者在每次取出后检查
+ *
+ * 两方频繁读写的字段按生产者和消费者分成两组，用 SPSC_CACHELINE 隔开，一方修改
+ * 自己的下标不会使对方的缓存行失效。parked 标志放在读它的一方的组里，只有睡眠
+ * 时才会被对方修改。
+ *
+ * 每一方都缓存对方的下标，只有按缓存的值看来队列已满（或已空）时才重新读取对
+ * 方的下标，平时只访问自己的缓存行。
+ *
+ * in 和 out 的修改是 release，读取对方的下标是 acquire，保证元素本身在下标之前
+ * 可见，不需要完整的内存屏障。
+ */
 typedef struct {
-    volatile unsigned int in;
-    volatile unsigned int out;
+    ItemType *data;
     unsigned int mask;
-    ItemType * volatile data;
+    int wait;
+    char pad0[SPSC_CACHELINE];
+
+    unsigned int in;
+    unsigned int out_cache;
+    int pop_parked;
+#ifdef PERFCNT
+    struct {
+        size_t wait;
+        size_t cnt;
+    } push;
+#endif
+    char pad1[SPSC_CACHELINE];
+
+    unsigned int out;
+    unsigned int in_cache;
+    int push_parked;
 #ifdef PERFCNT
     struct {
         size_t wait;
         size_t cnt;
-    } push, pop;
+    } pop;
 #endif
+    char pad2[SPSC_CACHELINE];
 } SpscQueue;
 
 SpscQueue SpscQueue_new(unsigned int size);
@@ -36,16 +91,25 @@ int SpscQueue_empty(SpscQueue *self);
 
 void SpscQueue_push(SpscQueue *self, ItemType data);
 
+void SpscQueue_push_n(SpscQueue *self, const ItemType *items, unsigned int n);
+
 int SpscQueue_full(SpscQueue *self);
 
 ItemType SpscQueue_pop(SpscQueue *self);
 
+unsigned int SpscQueue_pop_n(SpscQueue *self, ItemType *items, unsigned int n);
+
 size_t SpscQueue_size(SpscQueue *self);
 
 void SpscQueue_perf(SpscQueue *self, const char *prompt);
 
-#define SpscQueue_empty(self) ((self)->out == (self)->in)
+#define SpscQueue_load_(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+
+#define SpscQueue_empty(self) (SpscQueue_load_((self)->out) == SpscQueue_load_((self)->in))
 
-#define SpscQueue_full(self) ((self)->in - (self)->out == (self)->mask + 1)
+#define SpscQueue_full(self) \
+    (SpscQueue_load_((self)->in) - SpscQueue_load_((self)->out) == (self)->mask + 1)
 
-#define SpscQueue_size(self) ((self)->in - (self)->out)
+#define SpscQueue_size(self) (SpscQueue_load_((self)->in) - SpscQueue_load_((self)->out))
+
+#endif
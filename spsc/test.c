@@ -1,45 +1,139 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include "spsc.h"
 
+/*
+ * 不带参数时检查两种等待策略下，逐个和成批（push_n/pop_n）存取的正确性。
+ *
+ * 带参数 bench 时比较各种组合的吞吐量和 CPU 时间：
+ *   fast - 生产者和消费者都全速运行
+ *   slow - 消费者每取 SLOWEVERY 个数据就睡眠 SLOWUS 微秒，模拟在做 I/O
+ *   batch - 1 为逐个存取，否则每次成批放入不超过 BATCH 个，成批取出
+ */
+
 SpscQueue fifo;
-#define RANDNUMSIZE 10000000
+#define RANDNUMSIZE 1000000
+#define SLOWEVERY 1000
+#define SLOWUS 100
+#define BATCH 32
 int randnums[RANDNUMSIZE];
 int outnums[RANDNUMSIZE];
 int arr_read_pos;
 int arr_write_pos;
+int total;
+int slow;
+int batch;
 
 void *producer(void *ptr) {
-    while (arr_read_pos < RANDNUMSIZE) {
-        SpscQueue_push(&fifo, randnums[arr_read_pos++]);
+    ItemType items[BATCH];
+    while (arr_read_pos < total) {
+        /* 每批的数量在 1 到 batch 之间变化，覆盖环形缓冲区回绕的各种位置 */
+        int n = arr_read_pos % batch + 1;
+        if (n > total - arr_read_pos)
+            n = total - arr_read_pos;
+        for (int k = 0; k < n; ++k)
+            items[k] = (ItemType)(intptr_t)randnums[arr_read_pos + k];
+        if (n == 1)
+            SpscQueue_push(&fifo, items[0]);
+        else
+            SpscQueue_push_n(&fifo, items, n);
+        arr_read_pos += n;
     }
     return NULL;
 }
 
 void *customer(void *ptr) {
-    while (arr_write_pos < RANDNUMSIZE) {
-        outnums[arr_write_pos++] = SpscQueue_pop(&fifo);
+    ItemType items[BATCH];
+    while (arr_write_pos < total) {
+        int n = 1;
+        if (batch == 1)
+            items[0] = SpscQueue_pop(&fifo);
+        else
+            n = SpscQueue_pop_n(&fifo, items, batch);
+        for (int k = 0; k < n; ++k)
+            outnums[arr_write_pos + k] = (int)(intptr_t)items[k];
+        if (slow && arr_write_pos / SLOWEVERY != (arr_write_pos + n) / SLOWEVERY)
+            usleep(SLOWUS);
+        arr_write_pos += n;
     }
     return NULL;
 }
 
-int main(void) {
-    time_t t;
-    srand((unsigned) time(&t));
-    for (int i = 0; i < RANDNUMSIZE; ++i) {
-        randnums[i] = rand() % 100;
-    }
+static double seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/**
+ * run() - 用给定的等待策略传递 n 个数据，返回是否正确
+ *
+ * @wall @cpu - 所用的墙上时间和 CPU 时间（秒）
+ */
+static int run(int wait, int n, double *wall, double *cpu) {
+    struct timespec begin, end;
+    struct rusage ru0, ru1;
+
+    total = n;
+    arr_read_pos = arr_write_pos = 0;
+    memset(outnums, 0, sizeof(int) * n);
     fifo = SpscQueue_new(100);
+    fifo.wait = wait;
+
+    getrusage(RUSAGE_SELF, &ru0);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
     pthread_t t1, t2;
     pthread_create(&t1, NULL, producer, NULL);
     pthread_create(&t2, NULL, customer, NULL);
     pthread_join(t1, NULL);
     pthread_join(t2, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &ru1);
     SpscQueue_drop(&fifo);
+
+    *wall = end.tv_sec - begin.tv_sec + (end.tv_nsec - begin.tv_nsec) * 1e-9;
+    *cpu = seconds(ru1.ru_utime) - seconds(ru0.ru_utime)
+        + seconds(ru1.ru_stime) - seconds(ru0.ru_stime);
+    return memcmp(randnums, outnums, sizeof(int) * n) == 0;
+}
+
+int main(int argc, char **argv) {
+    static const char *names[] = { "adaptive", "spin" };
+    time_t t;
+    double wall, cpu;
+
+    srand((unsigned) time(&t));
     for (int i = 0; i < RANDNUMSIZE; ++i) {
-        if (randnums[i] != outnums[i]) {
-            return 1;
+        randnums[i] = rand() % 100;
+    }
+
+    if (argc < 2 || strcmp(argv[1], "bench") != 0) {
+        /* 单核机器上忙等的一方要用完时间片才让出 CPU，所以 SPSC_WAIT_SPIN 只检查少量数据 */
+        for (batch = 1; batch <= BATCH; batch += BATCH - 1) {
+            for (slow = 0; slow <= 1; ++slow) {
+                if (!run(SPSC_WAIT_ADAPTIVE, RANDNUMSIZE / (slow ? 100 : 1), &wall, &cpu))
+                    return 1;
+                if (!run(SPSC_WAIT_SPIN, RANDNUMSIZE / 100, &wall, &cpu))
+                    return 1;
+            }
+        }
+        return 0;
+    }
+
+    printf("%-6s %-9s %5s %12s %8s %8s\n", "case", "wait", "batch", "items/s", "wall/s", "cpu/s");
+    for (slow = 0; slow <= 1; ++slow) {
+        int n = RANDNUMSIZE / (slow ? 100 : 10);
+        for (int wait = SPSC_WAIT_ADAPTIVE; wait <= SPSC_WAIT_SPIN; ++wait) {
+            for (batch = 1; batch <= BATCH; batch += BATCH - 1) {
+                if (!run(wait, n, &wall, &cpu))
+                    return 1;
+                printf("%-6s %-9s %5d %12.0f %8.3f %8.3f\n", slow ? "slow" : "fast",
+                        names[wait], batch, n / wall, wall, cpu);
+            }
         }
     }
     return 0;
@@ -14,5 +14,11 @@
  */
 #define M(x) (((x) + m) % m)
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/**
+ * ROUNDUP() - 将 x 向上取整到 a 的整数倍
+ */
+#define ROUNDUP(x, a) (((x) + (a) - 1) / (a) * (a))
 
 #endif